@@ -0,0 +1,211 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "aot.h"
+#include "flags.h"
+#include "lcd.h"
+#include "sched.h"
+#include "timer.h"
+
+// cpu_run() for builds with a recompiled ROM (AOT=, see recomp/).
+//
+// With AOT_VERIFY the interpreter also runs, on a shadow machine, and the
+// two are checked against each other.
+
+#ifdef CPU_AOT
+
+#ifdef AOT_VERIFY
+
+// The shadow machine is seeded from the real one once and then left to
+// itself: run_cycles() takes its interrupts and sees to its HALTs and EIs,
+// and shadow_events() handles its scheduled events as run() does the real
+// machine's.  After each call here it's brought up to the real machine's
+// cycle count, which must land on an instruction boundary of its own too,
+// and once a frame's worth of cycles (verify_at) the two are compared in
+// full.
+static cpu_t *shadow;
+static uint64_t verify_at;
+
+// cpu_run() for the shadow.
+static int interpret(cpu_t *cpu, int budget) {
+    int elapsed = 0;
+
+    do {
+        int t = step(cpu);
+        if (t < 0) {
+            return t;
+        }
+        elapsed += t;
+        cpu->cycles += t;
+    } while (elapsed < budget && !cpu->stop);
+
+    return elapsed;
+}
+
+static void mismatch(cpu_t const *cpu, char const *what) {
+    fprintf(stderr, "aot: %s differs from the interpreter\n", what);
+    printf("recompiled:\n");
+    dump(cpu);
+    printf("interpreter:\n");
+    dump(shadow);
+    exit(1);
+}
+
+static void verify(cpu_t const *cpu) {
+    if (cpu->a != shadow->a || flags_get(cpu) != flags_get(shadow) || cpu->bc != shadow->bc ||
+        cpu->de != shadow->de || cpu->hl != shadow->hl ||
+        cpu->sp != shadow->sp || cpu->pc != shadow->pc) {
+        mismatch(cpu, "register state");
+    }
+    if (cpu->ime != shadow->ime || cpu->ei != shadow->ei || cpu->halted != shadow->halted ||
+        cpu->halt_bug != shadow->halt_bug || cpu->interrupts != shadow->interrupts) {
+        mismatch(cpu, "interrupt state");
+    }
+    if (cpu->rom_lock != shadow->rom_lock || cpu->cart.rom_bank0 != shadow->cart.rom_bank0 ||
+        cpu->cart.rom_bank_selected != shadow->cart.rom_bank_selected ||
+        cpu->cart.ram_bank != shadow->cart.ram_bank || cpu->cart.ram_enabled != shadow->cart.ram_enabled) {
+        mismatch(cpu, "memory map");
+    }
+    if (cpu->cart.ram_size && memcmp(cpu->cart.ram, shadow->cart.ram, cpu->cart.ram_size)) {
+        mismatch(cpu, "cart RAM");
+    }
+    for (int i = 0; i < sizeof(cpu->ram); ++i) {
+        if (cpu->ram[i] != shadow->ram[i]) {
+            fprintf(stderr, "aot: $%04x: %02x, interpreter %02x\n", i, cpu->ram[i], shadow->ram[i]);
+            mismatch(cpu, "memory");
+        }
+    }
+    if (cpu->lcd.lcdc != shadow->lcd.lcdc || cpu->lcd.stat != shadow->lcd.stat ||
+        cpu->lcd.bgp != shadow->lcd.bgp ||
+        cpu->lcd.scx != shadow->lcd.scx || cpu->lcd.scy != shadow->lcd.scy ||
+        cpu->lcd.origin != shadow->lcd.origin || cpu->lcd.drawn != shadow->lcd.drawn ||
+        cpu->joypad != shadow->joypad ||
+        memcmp(&cpu->timer, &shadow->timer, sizeof(cpu->timer)) ||
+        memcmp(&cpu->apu, &shadow->apu, sizeof(cpu->apu))) {
+        mismatch(cpu, "I/O register state");
+    }
+    if (memcmp(&cpu->sched, &shadow->sched, sizeof(cpu->sched))) {
+        mismatch(cpu, "event schedule");
+    }
+}
+
+// run()'s event handling, less the frontend's part: the shadow draws
+// nothing, and all nr_step() does to what the guest sees is take the
+// trigger bits out of NR14 and NR24.
+static void shadow_events(cpu_t *cpu) {
+    int ev;
+    uint64_t due;
+
+    while ((ev = sched_pop(cpu, &due)) >= 0) {
+        switch (ev) {
+            case EVENT_LCD:
+                lcd_event(cpu, due);
+                break;
+
+            case EVENT_APU:
+                cpu->apu.nr14 &= ~0x80;
+                cpu->apu.nr24 &= ~0x80;
+                sched_at(cpu, EVENT_APU, due + FRAME_SEQ_CYCLES);
+                break;
+
+            case EVENT_DMA:
+                cpu_dma(cpu);
+                break;
+
+            case EVENT_SERIAL:
+                cpu_serial(cpu);
+                break;
+
+            case EVENT_TIMER:
+                timer_overflow(cpu, due);
+                break;
+        }
+    }
+}
+
+// Runs the shadow up to cycle to, as run() and run_cycles() would.  Events
+// due at to itself wait for the next call, as the real machine's do until
+// this call returns.
+static void shadow_run(uint64_t to) {
+    while (shadow->cycles < to) {
+        shadow_events(shadow);
+        if (run_cycles(shadow, to - shadow->cycles) < 0) {
+            mismatch(shadow, "interpreter");
+        }
+    }
+}
+
+static void shadow_init(cpu_t const *cpu) {
+    shadow = malloc(sizeof(*shadow));
+    if (!shadow) {
+        fprintf(stderr, "couldn't allocate shadow CPU\n");
+        exit(1);
+    }
+    memcpy(shadow, cpu, sizeof(*cpu));
+    if (cpu->cart.ram_size) {
+        shadow->cart.ram = malloc(cpu->cart.ram_size);
+        if (!shadow->cart.ram) {
+            fprintf(stderr, "couldn't allocate shadow cart RAM\n");
+            exit(1);
+        }
+        memcpy(shadow->cart.ram, cpu->cart.ram, cpu->cart.ram_size);
+    }
+    shadow->lcd.draw_line = NULL;
+    shadow->breakpoints = NULL;
+    cpu_map(shadow);
+    verify_at = cpu->cycles + LCD_FRAME_CYCLES;
+}
+
+void aot_joypad(cpu_t const *cpu) {
+    if (!shadow || cpu == shadow) {
+        return;
+    }
+
+    // run() has handled the real machine's events due by now.
+    shadow_run(cpu->cycles);
+    shadow_events(shadow);
+    cpu_joypad(shadow, cpu->joypad);
+}
+
+int cpu_run(cpu_t *cpu, int budget) {
+    if (cpu == shadow) {
+        return interpret(cpu, budget);
+    }
+    if (!shadow) {
+        shadow_init(cpu);
+    }
+
+    shadow_run(cpu->cycles);
+    int t = aot_run(cpu, budget);
+    if (t < 0) {
+        return t;
+    }
+    shadow_run(cpu->cycles);
+    if (shadow->cycles != cpu->cycles) {
+        fprintf(stderr, "aot: at cycle %llu, interpreter at %llu\n",
+                (unsigned long long) cpu->cycles, (unsigned long long) shadow->cycles);
+        mismatch(cpu, "timing");
+    }
+
+    // Between an EI and the instruction after it, run_cycles() has yet to
+    // set IME on the real machine but already has on the shadow.
+    if (cpu->cycles >= verify_at && !cpu->ei) {
+        verify(cpu);
+        verify_at = cpu->cycles + LCD_FRAME_CYCLES;
+    }
+
+    return t;
+}
+
+#else
+
+int cpu_run(cpu_t *cpu, int budget) {
+    return aot_run(cpu, budget);
+}
+
+#endif
+
+#endif
+
+// vim: set sw=4 et:
@@ -0,0 +1,57 @@
+#ifndef AOT_H
+#define AOT_H
+
+#include "cpu.h"
+
+// The ROM translated to C by recomp/.  Runs like cpu_run(), falling back on
+// step() for any code that wasn't translated.
+int aot_run(cpu_t *cpu, int budget);
+
+#ifdef AOT_VERIFY
+// Gives the AOT_VERIFY shadow machine the keys cpu_joypad() just set on
+// cpu, at the same cycle.
+void aot_joypad(cpu_t const *cpu);
+#endif
+
+// For use by the generated aot_run(), which keeps elapsed and budget in
+// locals of those names.  AOT_NEXT ends an instruction that carries on
+// with the one at to; AOT_JUMP one that transfers control to to.  Both
+// count the instruction's cycles in cpu->cycles, and return once the
+// budget is used up or cpu->stop is set, leaving cpu->pc on the next
+// instruction.
+#define AOT_NEXT(to, t) \
+    do { \
+        elapsed += (t); \
+        cpu->cycles += (t); \
+        if (elapsed >= budget || cpu->stop) { \
+            cpu->pc = (to); \
+            return elapsed; \
+        } \
+    } while (0)
+
+#define AOT_JUMP(to, t) \
+    do { \
+        cpu->pc = (to); \
+        elapsed += (t); \
+        cpu->cycles += (t); \
+        if (elapsed >= budget || cpu->stop) { \
+            return elapsed; \
+        } \
+    } while (0)
+
+#define AOT_INTERPRET() \
+    do { \
+        int t = step(cpu); \
+        if (t < 0) { \
+            return t; \
+        } \
+        elapsed += t; \
+        cpu->cycles += t; \
+        if (elapsed >= budget || cpu->stop) { \
+            return elapsed; \
+        } \
+    } while (0)
+
+#endif
+
+// vim: set sw=4 et:
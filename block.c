@@ -0,0 +1,303 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "ops.h"
+#include "block.h"
+#include "jit.h"
+#include "fuse.h"
+#include "flags.h"
+#include "sched.h"
+
+// The cached interpreter.  Straight-line runs of guest code are decoded
+// once into blocks of pre-resolved instructions: the table entry (handler,
+// register fields and cycles), the immediate operand, and the PC after the
+// instruction.  Blocks are keyed by ROM bank and PC, so each bank switched
+// in through rom_bank_selected gets its own, and live in a direct-mapped
+// table.  Blocks decoded from RAM mark their lines in cpu->code_lines so a
+// write there drops them.
+
+#define BLOCK_COUNT 2048
+
+// What bank_of() gives for the boot ROM, and what it tags each ROM
+// window's banks with, so that no two windows share a value: MBC5 can
+// switch bank 0 in at $4000, which mustn't look like the fixed bank, or
+// like RAM's 0.
+#define BOOT_BANK 0xffff
+#define BANK0_WINDOW 0x1000
+#define BANKN_WINDOW 0x2000
+
+struct block_cache {
+    struct block blocks[BLOCK_COUNT];
+};
+
+void block_init(cpu_t *cpu) {
+    cpu->blocks = calloc(1, sizeof(struct block_cache));
+    if (!cpu->blocks) {
+        fprintf(stderr, "couldn't allocate block cache\n");
+        exit(1);
+    }
+}
+
+void block_flush(cpu_t *cpu) {
+    if (!cpu->blocks) {
+        return;
+    }
+
+    for (int i = 0; i < BLOCK_COUNT; ++i) {
+        cpu->blocks->blocks[i].count = 0;
+    }
+    memset(cpu->code_lines, 0, sizeof(cpu->code_lines));
+    cpu->block_exit = 1;
+}
+
+static struct block *slot(cpu_t *cpu, uint32_t key) {
+    return &cpu->blocks->blocks[(key ^ (key >> 11)) & (BLOCK_COUNT - 1)];
+}
+
+void block_invalidate(cpu_t *cpu, uint16_t addr) {
+    int line = addr & ~0x3f;
+
+    // RAM blocks are keyed by PC alone, so only the slots for blocks that
+    // could reach into this line need looking at.
+    for (int pc = line - BLOCK_MAX * 3 + 1; pc < line + 0x40; ++pc) {
+        if (pc < 0x8000) {
+            continue;
+        }
+        struct block *b = slot(cpu, pc);
+        if (b->count && b->key == pc && b->end > line) {
+            b->count = 0;
+        }
+    }
+    cpu->code_lines[addr >> 6] = 0;
+    cpu->block_exit = 1;
+}
+
+#ifdef CPU_BLOCKS
+
+// What's mapped at pc, for the high half of a block's key: the boot ROM,
+// a bank in the $0000 or $4000 window, or 0 for RAM, whose blocks are
+// keyed by PC alone.
+static int bank_of(cpu_t const *cpu, uint16_t pc) {
+    if (pc < 0x100 && cpu->rom_lock) {
+        return BOOT_BANK;
+    } else if (pc < 0x4000) {
+        return BANK0_WINDOW | cpu->cart.rom_bank0;
+    } else if (pc < 0x8000) {
+        return BANKN_WINDOW | cpu->cart.rom_bank_selected;
+    }
+    return 0;
+}
+
+static uint32_t key_of(cpu_t const *cpu, uint16_t pc) {
+    return ((uint32_t) bank_of(cpu, pc) << 16) | pc;
+}
+
+// Which registers the instruction with opcode op and operand n reads
+// memory through, as READ_* bits.
+static int reads_of(uint8_t op, uint16_t n) {
+    if (op == 0x0a) {
+        return READ_BC;
+    } else if (op == 0x1a) {
+        return READ_DE;
+    } else if (op == 0x2a || op == 0x3a || ((op & 0xc7) == 0x46 && op != 0x76) ||
+               (op & 0xc7) == 0x86 || (op == 0xcb && (n & 0x7) == 6)) {
+        return READ_HL;
+    }
+    return 0;
+}
+
+static void decode_block(cpu_t *cpu, struct block *b, uint32_t key, uint16_t pc) {
+    b->key = key;
+    b->start = pc;
+    b->count = 0;
+    b->hits = 0;
+    b->native = NULL;
+    b->pre_cycles = 0;
+    b->idle = 1;
+    b->reads = 0;
+    b->ticks = 0;
+
+    while (b->count < BLOCK_MAX) {
+        struct decoded *d = &b->code[b->count++];
+        uint8_t op = GET8(cpu, pc++);
+        d->op = ops[op];
+        d->n = 0;
+        if (d->op.len > 0) {
+            d->n = GET8(cpu, pc++);
+        }
+        if (d->op.len > 1) {
+            d->n |= GET8(cpu, pc++) << 8;
+        }
+        b->reads |= reads_of(op, d->n);
+        if (op == 0xf0 || op == 0xfa) {
+            b->ticks |= cpu_ticking(op == 0xf0 ? 0xff00 + d->n : d->n);
+        }
+        if (d->op.fn == ops[0xcb].fn) {
+            d->op = cb_ops[d->n];
+            d->n = 0;
+        }
+        d->pc = pc;
+        d->fused = NULL;
+        b->pre_cycles += d->op.cycles;
+        if (d->op.flags & OP_STORE) {
+            b->idle = 0;
+        }
+
+        // Stop at anything that loads PC, and where the next instruction
+        // would come from a different bank.
+        if (d->op.flags & OP_JUMP || key_of(cpu, pc) >> 16 != key >> 16) {
+            break;
+        }
+    }
+
+    b->pre_cycles -= b->code[b->count - 1].op.cycles;
+    if (!(b->code[b->count - 1].op.flags & OP_JUMP)) {
+        b->idle = 0;
+    }
+    b->end = pc;
+    if (b->start >= 0x8000) {
+        for (int line = b->start >> 6; line <= (b->end - 1) >> 6; ++line) {
+            cpu->code_lines[line] = 1;
+        }
+    }
+
+    fuse_block(b);
+}
+
+static struct block *lookup(cpu_t *cpu, uint16_t pc) {
+    uint32_t key = key_of(cpu, pc);
+    struct block *b = slot(cpu, key);
+
+    if (!b->count || b->key != key) {
+        decode_block(cpu, b, key, pc);
+    }
+    return b;
+}
+
+// Runs b, or as much of it as fits in left cycles.
+static int run_block(cpu_t *cpu, struct block *b, int left) {
+    struct decoded const *d = b->code, *end = b->code + b->count;
+    int elapsed = 0;
+
+    cpu->block_exit = 0;
+
+#ifdef CPU_JIT
+    // Native code runs the whole block without watching the budget, so
+    // only enter it when the interpreter would have run the whole block
+    // too.
+    if (!b->native && ++b->hits >= JIT_THRESHOLD) {
+        b->native = jit_compile(b);
+    }
+    if (b->native && b->pre_cycles < left) {
+        flags_sync(cpu);
+        return b->native(cpu);
+    }
+#endif
+
+    do {
+        // A fused run stands in for the instructions it covers when
+        // they'd all have run anyway (fuse.c).
+        struct decoded const *e = d;
+        if (d->fused && elapsed + d->fused->pre_cycles < left) {
+            e = &d->fused->d;
+            d += d->fused->count - 1;
+        }
+        cpu->pc = e->pc;
+        int t = e->op.fn(cpu, &e->op, e->n);
+        if (t < 0) {
+            return t;
+        }
+        elapsed += e->op.cycles + t;
+        cpu->cycles += e->op.cycles + t;
+    } while (++d < end && !cpu->block_exit && elapsed < left);
+
+    return elapsed;
+}
+
+// The registers an idle loop has to leave alone.
+struct regs {
+    uint8_t a, f;
+    uint16_t bc, de, hl, sp;
+};
+
+static void save_regs(cpu_t const *cpu, struct regs *r) {
+    *r = (struct regs) {
+        .a = cpu->a, .f = flags_get(cpu),
+        .bc = cpu->bc, .de = cpu->de, .hl = cpu->hl, .sp = cpu->sp,
+    };
+}
+
+static int same_regs(cpu_t const *cpu, struct regs const *r) {
+    return cpu->a == r->a && flags_get(cpu) == r->f && cpu->bc == r->bc &&
+        cpu->de == r->de && cpu->hl == r->hl && cpu->sp == r->sp;
+}
+
+// The first cycle after from at which a register b reads, run with the
+// registers in r, changes by itself (cpu_next_tick()).
+static uint64_t next_tick(cpu_t const *cpu, struct block const *b, struct regs const *r,
+                          uint64_t from) {
+    int ticks = b->ticks;
+
+    if (b->reads & READ_BC) {
+        ticks |= cpu_ticking(r->bc);
+    }
+    if (b->reads & READ_DE) {
+        ticks |= cpu_ticking(r->de);
+    }
+    if (b->reads & READ_HL) {
+        ticks |= cpu_ticking(r->hl);
+    }
+    return ticks ? cpu_next_tick(cpu, ticks, from) : SCHED_NEVER;
+}
+
+int cpu_run(cpu_t *cpu, int budget) {
+    int elapsed = 0;
+
+    do {
+#ifdef CPU_JIT
+        if (jit_full()) {
+            block_flush(cpu);
+            jit_reset();
+        }
+#endif
+
+        struct block *b = lookup(cpu, cpu->pc);
+        struct regs before = { 0 };
+        if (b->idle) {
+            save_regs(cpu, &before);
+        }
+
+        int t = run_block(cpu, b, budget - elapsed);
+        if (t < 0) {
+            return t;
+        }
+        elapsed += t;
+
+        // Nothing but the CPU changes memory or I/O registers until the
+        // budget runs out (run() makes it the next scheduled event), bar
+        // the ones that tick (DIV, TIMA, LY, STAT), so a loop that stores
+        // nothing and comes back to where it started with the same
+        // registers will keep doing exactly that, polling LY or a flag,
+        // until then or until something it reads ticks.  Skip ahead to
+        // its last time round before that, which runs as usual.
+        if (b->idle && !cpu->stop && cpu->pc == b->start && same_regs(cpu, &before)) {
+            int skip = (budget - elapsed - 1) / t * t;
+            uint64_t tick = skip > 0 ? next_tick(cpu, b, &before, cpu->cycles - t) : SCHED_NEVER;
+            if (tick < cpu->cycles + skip) {
+                skip = tick > cpu->cycles ? (tick - cpu->cycles - 1) / t * t : 0;
+            }
+            if (skip > 0) {
+                elapsed += skip;
+                cpu->cycles += skip;
+                cpu->idle_cycles += skip;
+            }
+        }
+    } while (elapsed < budget && !cpu->stop);
+
+    return elapsed;
+}
+
+#endif
+
+// vim: set sw=4 et:
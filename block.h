@@ -0,0 +1,67 @@
+#ifndef BLOCK_H
+#define BLOCK_H
+
+#include "cpu.h"
+#include "ops.h"
+
+#define BLOCK_MAX 16
+
+// The registers a block reads memory through, which could point at a
+// register that ticks (cpu_ticking()).
+#define READ_BC    (1 << 0)
+#define READ_DE    (1 << 1)
+#define READ_HL    (1 << 2)
+
+// One pre-decoded instruction: its table entry, immediate operand, and the
+// PC after it, and a fused handler for the idiom it starts, if any.
+struct decoded {
+    struct opcode op;
+    uint16_t n;
+    uint16_t pc;
+    struct fused const *fused;
+};
+
+// A run of instructions done by one handler (fuse.c): the handler's entry,
+// how many instructions it stands for, and the cycles of all but the last
+// of them, which must fit in the budget for it to be used.
+struct fused {
+    struct decoded d;
+    int count;
+    int pre_cycles;
+};
+
+struct block {
+    uint32_t key;
+    uint16_t start, end;
+    int count;
+    struct decoded code[BLOCK_MAX];
+    struct fused fused[BLOCK_MAX / 2];
+
+    // Whether it ends in a jump and stores nothing, so that if it jumps
+    // back to its start with the registers unchanged it's an idle loop;
+    // and how it reads memory: through which registers (READ_*), and the
+    // ticking registers (TICK_*) it reads at fixed addresses, since an idle
+    // loop only stays idle until one of those changes.
+    int idle;
+    int reads;
+    int ticks;
+
+    // JIT state: how often the block has run, its native code once it's
+    // been compiled, and the cycles of all but its last instruction.
+    int hits;
+    int (*native)(cpu_t *cpu);
+    int pre_cycles;
+};
+
+void block_init(cpu_t *cpu);
+
+// Drops every cached block.
+void block_flush(cpu_t *cpu);
+
+// Drops the blocks decoded from the 64-byte line holding addr.  SET8 calls
+// this for lines marked in cpu->code_lines.
+void block_invalidate(cpu_t *cpu, uint16_t addr);
+
+#endif
+
+// vim: set sw=4 et:
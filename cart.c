@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "block.h"
+#include "cart.h"
+
+// Cartridges.  Each MBC has its own cart_write handler, picked from the
+// header when the cart is loaded.  A write to one of its registers updates
+// the banks it selects, and cart_map() repoints the pages they're mapped
+// at, so reading from a switched bank costs the same as any other read.
+// Cart RAM that's disabled, MBC2's 4-bit RAM and MBC3's clock registers
+// aren't plain bytes, so their pages are left unmapped and go through
+// cart_read and cart_write.
+
+void cart_map(cpu_t *cpu) {
+    uint8_t const *lo = cpu->cart.rom + cpu->cart.rom_bank0 * 0x4000,
+                  *hi = cpu->cart.rom + cpu->cart.rom_bank_selected * 0x4000;
+    for (int p = 0; p < 0x40; ++p) {
+        cpu->read_page[p] = lo + (p << 8);
+        cpu->read_page[0x40 + p] = hi + (p << 8);
+    }
+    if (cpu->rom_lock) {
+        cpu->read_page[0] = cpu->rom;
+    }
+
+    // Smaller RAMs are mirrored through the whole bank.
+    int plain = cpu->cart.ram_enabled && cpu->cart.ram_size && cpu->cart.mbc != 2 &&
+        !(cpu->cart.mbc == 3 && cpu->cart.ram_bank >= 0x8);
+    for (int p = 0xa0; p < 0xc0; ++p) {
+        uint8_t *page = NULL;
+        if (plain) {
+            page = cpu->cart.ram + (cpu->cart.ram_bank * 0x2000 + ((p - 0xa0) << 8)) % cpu->cart.ram_size;
+        }
+        cpu->read_page[p] = page;
+        cpu->write_page[p] = page;
+    }
+}
+
+// Selects the ROM banks mapped at $0000 and $4000, wrapping around the
+// banks the cart actually has.  The rest of the current block may have
+// come from the old bank.
+static void select_rom(cpu_t *cpu, int bank0, int bank) {
+    cpu->cart.rom_bank0 = bank0 % cpu->cart.rom_banks;
+    cpu->cart.rom_bank_selected = bank % cpu->cart.rom_banks;
+    cpu->block_exit = 1;
+}
+
+// Selects the RAM bank (or MBC3 clock register) at $A000, and enables or
+// disables it.  Blocks decoded from cart RAM are keyed by PC alone, so any
+// from the bank being switched out have to go.
+static void select_ram(cpu_t *cpu, int enabled, int bank) {
+    if (enabled == cpu->cart.ram_enabled && bank == cpu->cart.ram_bank) {
+        return;
+    }
+    for (int line = 0xa000 >> 6; line < 0xc000 >> 6; ++line) {
+        if (cpu->code_lines[line]) {
+            block_invalidate(cpu, line << 6);
+        }
+    }
+    cpu->cart.ram_enabled = enabled;
+    cpu->cart.ram_bank = bank;
+}
+
+// Disabled or missing cart RAM reads as $FF and ignores writes.
+static uint8_t no_ram_read(cpu_t const *cpu, uint16_t addr) {
+    return 0xff;
+}
+
+// No MBC: 32K of ROM, and maybe 8K of RAM that's always mapped.
+static void rom_only_write(cpu_t *cpu, uint16_t addr, uint8_t v) {
+}
+
+static void mbc1_write(cpu_t *cpu, uint16_t addr, uint8_t v) {
+    switch (addr >> 13) {
+    case 0:
+        select_ram(cpu, (v & 0xf) == 0xa, cpu->cart.ram_bank);
+        break;
+    case 1:
+        cpu->cart.mbc_lo = v & 0x1f ? v & 0x1f : 1;
+        break;
+    case 2:
+        cpu->cart.mbc_hi = v & 0x3;
+        break;
+    case 3:
+        cpu->cart.mbc_mode = v & 0x1;
+        break;
+    default:
+        return;
+    }
+
+    // The two high bits go to the switchable bank, and in mode 1 also to
+    // the bank at $0000 and the RAM bank.
+    select_rom(cpu, cpu->cart.mbc_mode ? cpu->cart.mbc_hi << 5 : 0, cpu->cart.mbc_hi << 5 | cpu->cart.mbc_lo);
+    select_ram(cpu, cpu->cart.ram_enabled, cpu->cart.mbc_mode ? cpu->cart.mbc_hi : 0);
+    cart_map(cpu);
+}
+
+// MBC2: 512 4-bit cells of RAM, repeated through $A000-$BFFF.
+static uint8_t mbc2_read(cpu_t const *cpu, uint16_t addr) {
+    return cpu->cart.ram_enabled ? 0xf0 | cpu->cart.ram[addr & 0x1ff] : 0xff;
+}
+
+static void mbc2_write(cpu_t *cpu, uint16_t addr, uint8_t v) {
+    if (addr >= 0xa000) {
+        if (cpu->cart.ram_enabled) {
+            cpu->cart.ram[addr & 0x1ff] = v & 0xf;
+        }
+    } else if (addr < 0x4000) {
+        // Bit 8 of the address picks the register.
+        if (addr & 0x100) {
+            select_rom(cpu, 0, v & 0xf ? v & 0xf : 1);
+        } else {
+            select_ram(cpu, (v & 0xf) == 0xa, 0);
+        }
+        cart_map(cpu);
+    }
+}
+
+// Brings MBC3's clock up to date with the host's, unless it's halted.
+static void rtc_update(cpu_t *cpu) {
+    time_t now = time(NULL);
+    long t = now - cpu->cart.rtc_time;
+
+    cpu->cart.rtc_time = now;
+    if (cpu->cart.rtc[4] & 0x40 || t <= 0) {
+        return;
+    }
+
+    long days = cpu->cart.rtc[3] | (cpu->cart.rtc[4] & 0x1) << 8;
+    t += cpu->cart.rtc[0] + 60 * (cpu->cart.rtc[1] + 60 * (cpu->cart.rtc[2] + 24 * days));
+    cpu->cart.rtc[0] = t % 60;
+    t /= 60;
+    cpu->cart.rtc[1] = t % 60;
+    t /= 60;
+    cpu->cart.rtc[2] = t % 24;
+    days = t / 24;
+    if (days > 0x1ff) {
+        cpu->cart.rtc[4] |= 0x80;  // day counter carry
+    }
+    cpu->cart.rtc[3] = days & 0xff;
+    cpu->cart.rtc[4] = (cpu->cart.rtc[4] & 0xfe) | ((days >> 8) & 0x1);
+}
+
+static uint8_t mbc3_read(cpu_t const *cpu, uint16_t addr) {
+    if (cpu->cart.ram_enabled && cpu->cart.ram_bank >= 0x8 && cpu->cart.ram_bank <= 0xc) {
+        return cpu->cart.rtc_latched[cpu->cart.ram_bank - 0x8];
+    }
+    return 0xff;
+}
+
+static void mbc3_write(cpu_t *cpu, uint16_t addr, uint8_t v) {
+    static uint8_t const rtc_mask[5] = { 0x3f, 0x3f, 0x1f, 0xff, 0xc1 };
+
+    switch (addr >> 13) {
+    case 0:
+        select_ram(cpu, (v & 0xf) == 0xa, cpu->cart.ram_bank);
+        break;
+    case 1:
+        v &= 0x7f;
+        select_rom(cpu, 0, v ? v : 1);
+        break;
+    case 2:
+        select_ram(cpu, cpu->cart.ram_enabled, v & 0xf);
+        break;
+    case 3:
+        // Writing 0 then 1 latches the clock.
+        if (cpu->cart.rtc_latch == 0 && v == 1) {
+            rtc_update(cpu);
+            memcpy(cpu->cart.rtc_latched, cpu->cart.rtc, sizeof(cpu->cart.rtc));
+        }
+        cpu->cart.rtc_latch = v;
+        return;
+    default:
+        if (cpu->cart.ram_enabled && cpu->cart.ram_bank >= 0x8 && cpu->cart.ram_bank <= 0xc) {
+            rtc_update(cpu);
+            cpu->cart.rtc[cpu->cart.ram_bank - 0x8] = v & rtc_mask[cpu->cart.ram_bank - 0x8];
+        }
+        return;
+    }
+    cart_map(cpu);
+}
+
+static void mbc5_write(cpu_t *cpu, uint16_t addr, uint8_t v) {
+    switch (addr >> 12) {
+    case 0x0:
+    case 0x1:
+        select_ram(cpu, (v & 0xf) == 0xa, cpu->cart.ram_bank);
+        break;
+    case 0x2:
+        cpu->cart.mbc_lo = v;
+        select_rom(cpu, 0, cpu->cart.mbc_hi << 8 | cpu->cart.mbc_lo);
+        break;
+    case 0x3:
+        cpu->cart.mbc_hi = v & 0x1;
+        select_rom(cpu, 0, cpu->cart.mbc_hi << 8 | cpu->cart.mbc_lo);
+        break;
+    case 0x4:
+    case 0x5:
+        select_ram(cpu, cpu->cart.ram_enabled, v & 0xf);
+        break;
+    default:
+        return;
+    }
+    cart_map(cpu);
+}
+
+void cart_init(cpu_t *cpu, uint8_t const *cart, long size) {
+    static long const ram_sizes[6] = { 0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000 };
+
+    if (size < 0x8000) {
+        fprintf(stderr, "cart is only %ld bytes\n", size);
+        exit(1);
+    }
+
+    cpu->cart.rom = cart;
+    cpu->cart.rom_banks = size / 0x4000;
+    cpu->cart.ram_size = cart[0x0149] < 6 ? ram_sizes[cart[0x0149]] : 0;
+    cpu->cart.read = no_ram_read;
+    cpu->cart.rom_bank_selected = 1;
+    cpu->cart.mbc_lo = 1;
+    cpu->cart.rtc_time = time(NULL);
+
+    switch (cart[0x0147]) {
+    case 0x00:
+    case 0x08:
+    case 0x09:
+        cpu->cart.mbc = 0;
+        cpu->cart.write = rom_only_write;
+        cpu->cart.ram_enabled = 1;
+        break;
+    case 0x01:
+    case 0x02:
+    case 0x03:
+        cpu->cart.mbc = 1;
+        cpu->cart.write = mbc1_write;
+        break;
+    case 0x05:
+    case 0x06:
+        cpu->cart.mbc = 2;
+        cpu->cart.read = mbc2_read;
+        cpu->cart.write = mbc2_write;
+        cpu->cart.ram_size = 0x200;
+        break;
+    case 0x0f:
+    case 0x10:
+    case 0x11:
+    case 0x12:
+    case 0x13:
+        cpu->cart.mbc = 3;
+        cpu->cart.read = mbc3_read;
+        cpu->cart.write = mbc3_write;
+        break;
+    case 0x19:
+    case 0x1a:
+    case 0x1b:
+    case 0x1c:
+    case 0x1d:
+    case 0x1e:
+        cpu->cart.mbc = 5;
+        cpu->cart.write = mbc5_write;
+        break;
+    default:
+        fprintf(stderr, "unknown MBC %02x\n", cart[0x0147]);
+        exit(1);
+    }
+
+    switch (cart[0x0147]) {
+    case 0x03:
+    case 0x06:
+    case 0x09:
+    case 0x0f:
+    case 0x10:
+    case 0x13:
+    case 0x1b:
+    case 0x1e:
+        cpu->cart.battery = 1;
+        break;
+    }
+    cpu->cart.clock = cart[0x0147] == 0x0f || cart[0x0147] == 0x10;
+
+    if (cpu->cart.ram_size) {
+        cpu->cart.ram = calloc(1, cpu->cart.ram_size);
+        if (!cpu->cart.ram) {
+            fprintf(stderr, "couldn't allocate cart RAM\n");
+            exit(1);
+        }
+    }
+}
+
+// vim: set sw=4 et:
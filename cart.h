@@ -0,0 +1,16 @@
+#ifndef CART_H
+#define CART_H
+
+#include "cpu.h"
+
+// Reads the cart's header and sets up its MBC and RAM.  cpu_map() maps it
+// in.
+void cart_init(cpu_t *cpu, uint8_t const *cart, long size);
+
+// Points the ROM and cart RAM pages of the memory map at the banks the MBC
+// has selected, and page 0 at the boot ROM while that's mapped in.
+void cart_map(cpu_t *cpu);
+
+#endif
+
+// vim: set sw=4 et:
@@ -2,290 +2,314 @@
 #include <string.h>
 
 #include "cpu.h"
-
-void cpu_init(cpu_t *cpu, uint8_t const *rom, uint8_t *cart) {
+#include "ops.h"
+#include "block.h"
+#include "flags.h"
+#include "cart.h"
+#include "sched.h"
+#include "timer.h"
+#include "lcd.h"
+#ifdef AOT_VERIFY
+#include "aot.h"
+#endif
+
+// trace.c compiles this file a second time, with CPU_TRACE defined, for a
+// tracing copy of the decoder, the handlers and step().  Everything else
+// is only built once, here.
+#ifndef CPU_TRACE
+
+static void io_init(void);
+static void check_interrupts(cpu_t *cpu);
+
+void cpu_init(cpu_t *cpu, uint8_t const *rom, uint8_t const *cart, long cart_size) {
     memset(cpu, 0, sizeof(*cpu));
 
+    ops_init();
+    flags_init();
+    io_init();
+#ifdef CPU_BLOCKS
+    block_init(cpu);
+#endif
+
     memcpy(cpu->rom, rom, 256);
-    cpu->cart = cart;
     cpu->pc = 0;
     cpu->rom_lock = 1;
-    cpu->rom_bank_selected = 1;
-    cpu->lcdc = 0x83;
-    cpu->lcdc_bgp = 0xd4;
-
-    switch (rom[0x0147]) {
-    case 0x00:
-        cpu->mbc = 0;
-        break;
-    case 0x01:
-    case 0x02:
-    case 0x03:
-        cpu->mbc = 1;
-        break;
-    case 0x05:
-    case 0x06:
-        cpu->mbc = 2;
-        break;
-    case 0x0f:
-    case 0x10:
-    case 0x11:
-    case 0x12:
-    case 0x13:
-        cpu->mbc = 3;
-        break;
-    case 0x19:
-    case 0x1a:
-    case 0x1b:
-    case 0x1c:
-    case 0x1d:
-    case 0x1e:
-        cpu->mbc = 5;
-        break;
-    default:
-        fprintf(stderr, "unknown MBC %02x\n", rom[0x0147]);
-        exit(1);
-    }
+    cpu->lcd.lcdc = 0x83;
+    cpu->lcd.bgp = 0xd4;
+
+    sched_init(cpu);
+    lcd_init(cpu);
+    cart_init(cpu, cart, cart_size);
+    cpu_map(cpu);
 }
 
 void dump(cpu_t const *cpu) {
     printf("\n");
     printf("======== CPU DUMP ========\n");
-    printf(" A: %02x      F: %02x\n", cpu->a, cpu->f);
+    printf(" A: %02x      F: %02x\n", cpu->a, flags_get(cpu));
     printf(" B: %02x      C: %02x\n", cpu->b, cpu->c);
     printf(" D: %02x      E: %02x\n", cpu->d, cpu->e);
     printf(" H: %02x      L: %02x\n", cpu->h, cpu->l);
     printf("SP: %04x   PC: %04x\n", cpu->sp, cpu->pc);
     printf("\n");
-    printf(" LCDC: %02x  BGP: %02x\n", cpu->lcdc, cpu->lcdc_bgp);
-    printf("SCX/Y: %02x/%02x\n", cpu->lcdc_scx, cpu->lcdc_scy);
+    printf(" LCDC: %02x  BGP: %02x\n", cpu->lcd.lcdc, cpu->lcd.bgp);
+    printf("SCX/Y: %02x/%02x\n", cpu->lcd.scx, cpu->lcd.scy);
     printf("==========================\n");
     printf("\n");
 }
 
-uint8_t GET8(cpu_t const *cpu, uint16_t addr) {
-    if (addr < 0x100 && cpu->rom_lock) {
-        return cpu->rom[addr];
-    } else if (addr < 0x4000) {
-        return cpu->cart[addr];
-    } else if (addr >= 0x4000 & addr < 0x8000) {
-        switch (cpu->mbc) {
-        case 0:
-            return cpu->cart[addr];
-        case 3:
-            return cpu->cart[addr + (cpu->rom_bank_selected) * 0x4000];
-        default:
-            fprintf(stderr, "what does an mbc do %02x\n", cpu->mbc);
-            exit(1);
+// The memory map: a host pointer to each 256-byte page that reads or writes
+// can go straight to, or NULL where something has to see the access.  That
+// leaves the I/O page, writes to VRAM and OAM, which the LCD has to catch
+// up before (lcd.c), and whatever the cartridge can't map (cart.c).
+void cpu_map(cpu_t *cpu) {
+    for (int p = 0; p < 0x100; ++p) {
+        cpu->read_page[p] = cpu->ram + (p << 8);
+        cpu->write_page[p] = p < 0xa0 ? NULL : cpu->ram + (p << 8);
+    }
+    cpu->read_page[0xff] = NULL;
+    cpu->write_page[0xfe] = NULL;
+    cpu->write_page[0xff] = NULL;
+    cart_map(cpu);
+}
+
+static void set_boot(cpu_t *cpu, uint8_t v) {
+    if (v != 0) {
+        cpu->rom_lock = 0;
+        cart_map(cpu);
+        block_flush(cpu);
+        printf("DMG ROM overlay removed\n");
+    }
+}
+
+// OAM DMA takes 160 machine cycles, one byte each.
+#define DMA_CYCLES (160 * 4)
+
+static void set_dma(cpu_t *cpu, uint8_t v) {
+    cpu->ram[0xff46] = v;
+    sched_at(cpu, EVENT_DMA, cpu->cycles + DMA_CYCLES);
+}
+
+void cpu_dma(cpu_t *cpu) {
+    lcd_catch_up(cpu);
+    uint16_t source = cpu->ram[0xff46] << 8;
+    for (int i = 0; i < 0xa0; ++i) {
+        cpu->ram[0xfe00 + i] = GET8(cpu, source + i);
+    }
+}
+
+// A byte takes 8 bits at 8192 Hz on the internal clock.
+#define SERIAL_CYCLES (8 * 512)
+
+static void set_sc(cpu_t *cpu, uint8_t v) {
+    cpu->ram[0xff02] = v;
+    if ((v & 0x81) == 0x81) {
+        sched_at(cpu, EVENT_SERIAL, cpu->cycles + SERIAL_CYCLES);
+    }
+}
+
+void cpu_serial(cpu_t *cpu) {
+    cpu->ram[0xff01] = 0xff;
+    cpu->ram[0xff02] &= 0x7f;
+    cpu_interrupt(cpu, INT_SERIAL);
+}
+
+void cpu_interrupt(cpu_t *cpu, uint8_t bits) {
+    cpu->ram[0xff0f] |= bits;
+    check_interrupts(cpu);
+}
+
+// P1: bits 4 and 5 select the direction keys and the buttons, 0 for
+// selected, and the low bits read the selected keys, 0 for held down.
+static uint8_t get_p1(cpu_t const *cpu) {
+    uint8_t v = cpu->ram[0xff00] | 0xcf;
+    if (!(cpu->ram[0xff00] & 0x10)) {
+        v &= ~(cpu->joypad & 0x0f);
+    }
+    if (!(cpu->ram[0xff00] & 0x20)) {
+        v &= ~(cpu->joypad >> 4);
+    }
+    return v;
+}
+
+// Any of P1's low bits falling raises the joypad interrupt, whether it's
+// a key going down or a group with one held being selected.
+static void update_p1(cpu_t *cpu, uint8_t select, uint8_t joypad) {
+    uint8_t was = get_p1(cpu);
+    cpu->ram[0xff00] = select & 0x30;
+    cpu->joypad = joypad;
+    if (was & ~get_p1(cpu) & 0x0f) {
+        cpu_interrupt(cpu, INT_JOYPAD);
+    }
+}
+
+static void set_p1(cpu_t *cpu, uint8_t v) {
+    update_p1(cpu, v, cpu->joypad);
+}
+
+void cpu_joypad(cpu_t *cpu, uint8_t keys) {
+    update_p1(cpu, cpu->ram[0xff00], keys);
+#ifdef AOT_VERIFY
+    aot_joypad(cpu);
+#endif
+}
+
+static uint8_t get_if(cpu_t const *cpu) {
+    return cpu->ram[0xff0f] | 0xe0;
+}
+
+static void set_if(cpu_t *cpu, uint8_t v) {
+    cpu->ram[0xff0f] = v & 0x1f;
+    check_interrupts(cpu);
+}
+
+// The I/O registers at $FF00-$FF7F, by address.  Each is a byte in cpu_t,
+// found by its offset like the register file; get and set are only there
+// for registers where an access does more than read or store that byte.
+// One with a get and no set is read-only: what it reads isn't the byte, so
+// writes to it are dropped.  io_init() points the ones without an entry at
+// their byte of cpu->ram.
+struct io_reg {
+    uint32_t offset;
+    uint8_t (*get)(cpu_t const *cpu);
+    void (*set)(cpu_t *cpu, uint8_t v);
+};
+
+#define IO(field, ...) { .offset = offsetof(cpu_t, field), __VA_ARGS__ }
+
+static struct io_reg io_regs[0x80] = {
+    [0x00] = IO(ram[0xff00], .get = get_p1, .set = set_p1),
+    [0x02] = IO(ram[0xff02], .set = set_sc),
+    [0x04] = IO(ram[0xff04], .get = timer_get_div, .set = timer_set_div),
+    [0x05] = IO(timer.tima, .get = timer_get_tima, .set = timer_set_tima),
+    [0x06] = IO(timer.tma),
+    [0x07] = IO(timer.tac, .get = timer_get_tac, .set = timer_set_tac),
+    [0x0f] = IO(ram[0xff0f], .get = get_if, .set = set_if),
+    [0x11] = IO(apu.nr11),
+    [0x12] = IO(apu.nr12),
+    [0x13] = IO(apu.nr13),
+    [0x14] = IO(apu.nr14),
+    [0x16] = IO(apu.nr21),
+    [0x17] = IO(apu.nr22),
+    [0x18] = IO(apu.nr23),
+    [0x19] = IO(apu.nr24),
+    [0x1a] = IO(apu.nr30),
+    [0x1b] = IO(apu.nr31),
+    [0x1c] = IO(apu.nr32),
+    [0x1d] = IO(apu.nr33),
+    [0x1e] = IO(apu.nr34),
+    [0x20] = IO(apu.nr41),
+    [0x21] = IO(apu.nr42),
+    [0x22] = IO(apu.nr43),
+    [0x23] = IO(apu.nr44),
+    [0x40] = IO(lcd.lcdc, .set = lcd_set_lcdc),
+    [0x41] = IO(lcd.stat, .get = lcd_get_stat, .set = lcd_set_stat),
+    [0x42] = IO(lcd.scy, .set = lcd_set_scy),
+    [0x43] = IO(lcd.scx, .set = lcd_set_scx),
+    [0x44] = IO(ram[0xff44], .get = lcd_get_ly),
+    [0x45] = IO(ram[0xff45], .set = lcd_set_lyc),
+    [0x46] = IO(ram[0xff46], .set = set_dma),
+    [0x47] = IO(lcd.bgp, .set = lcd_set_bgp),
+    [0x50] = IO(ram[0xff50], .set = set_boot),
+};
+
+#undef IO
+
+static void io_init(void) {
+    for (int i = 0; i < 0x80; ++i) {
+        if (!io_regs[i].offset) {
+            io_regs[i].offset = offsetof(cpu_t, ram) + 0xff00 + i;
         }
-    } else if (addr == 0xff11) {
-        // NR11
-        return cpu->nr11;
-    } else if (addr == 0xff12) {
-        // NR12
-        return cpu->nr12;
-    } else if (addr == 0xff13) {
-        // NR13
-        return cpu->nr13;
-    } else if (addr == 0xff14) {
-        // NR14
-        return cpu->nr14;
-    } else if (addr == 0xff16) {
-        // NR21
-        return cpu->nr21;
-    } else if (addr == 0xff17) {
-        // NR22
-        return cpu->nr22;
-    } else if (addr == 0xff18) {
-        // NR23
-        return cpu->nr23;
-    } else if (addr == 0xff19) {
-        // NR24
-        return cpu->nr24;
-    } else if (addr == 0xff1a) {
-        // NR30
-        return cpu->nr30;
-    } else if (addr == 0xff1b) {
-        // NR31
-        return cpu->nr31;
-    } else if (addr == 0xff1c) {
-        // NR32
-        return cpu->nr32;
-    } else if (addr == 0xff1d) {
-        // NR33
-        return cpu->nr33;
-    } else if (addr == 0xff1e) {
-        // NR34
-        return cpu->nr34;
-    } else if (addr == 0xff20) {
-        // NR41
-        return cpu->nr41;
-    } else if (addr == 0xff21) {
-        // NR42
-        return cpu->nr42;
-    } else if (addr == 0xff22) {
-        // NR43
-        return cpu->nr43;
-    } else if (addr == 0xff23) {
-        // NR44
-        return cpu->nr44;
-    } else if (addr == 0xff40) {
-        // LCDC
-        return cpu->lcdc;
-    } else if (addr == 0xff41) {
-        // STAT
-        return cpu->lcdc_mode;
-    } else if (addr == 0xff42) {
-        // SCY
-        return cpu->lcdc_scy;
-    } else if (addr == 0xff43) {
-        // SCX
-        return cpu->lcdc_scx;
-    } else if (addr == 0xff44) {
-        // LY
-        return cpu->lcdc_line;
-    } else if (addr == 0xff47) {
-        // BGP
-        return cpu->lcdc_bgp;
     }
-    return cpu->ram[addr];
 }
 
-void SET8(cpu_t *cpu, uint16_t addr, uint8_t v) {
-    if (addr == 0xff50) {
-        if (v != 0) {
-            cpu->rom_lock = 0;
-            printf("DMG ROM overlay removed\n");
+static uint8_t io_get8(cpu_t const *cpu, uint16_t addr) {
+    if (addr >= 0xff80) {
+        return cpu->ram[addr];
+    }
+
+    struct io_reg const *r = &io_regs[addr & 0x7f];
+    return r->get ? r->get(cpu) : *((uint8_t const *) cpu + r->offset);
+}
+
+static void io_set8(cpu_t *cpu, uint16_t addr, uint8_t v) {
+    if (cpu->code_lines[addr >> 6]) {
+        block_invalidate(cpu, addr);
+    }
+    if (addr >= 0xff80) {
+        cpu->ram[addr] = v;
+        if (addr == 0xffff) {
+            check_interrupts(cpu);
         }
         return;
     }
 
-    if (cpu->mbc == 3) {
-        if (addr >= 0x0000 & addr <= 0x1fff) {
-            printf("write $%02x to $%04x\n", v, addr);
-            exit(1);
-        }
+    struct io_reg const *r = &io_regs[addr & 0x7f];
+    if (r->set) {
+        r->set(cpu, v);
+    } else if (!r->get) {
+        *((uint8_t *) cpu + r->offset) = v;
+    }
+}
 
-        if (addr >= 0x2000 && addr <= 0x3fff) {
-            cpu->rom_bank_selected = v & 0x7f;
-            if (!cpu->rom_bank_selected) {
-                cpu->rom_bank_selected = 1;
-            }
-            return;
-        }
+int cpu_ticking(uint16_t addr) {
+    switch (addr) {
+        case 0xff04: return TICK_DIV;
+        case 0xff05: return TICK_TIMA;
+        case 0xff41:
+        case 0xff44: return TICK_LCD;
+    }
+    return 0;
+}
 
-        if (addr >= 0x4000 && addr <= 0x5fff) {
-            printf("write $%02x to $%04x\n", v, addr);
-            exit(1);
-        }
+uint64_t cpu_next_tick(cpu_t const *cpu, int ticks, uint64_t from) {
+    uint64_t next = SCHED_NEVER, t;
 
-        if (addr >= 0x6000 && addr <= 0x7fff) {
-            printf("write $%02x to $%04x\n", v, addr);
-            exit(1);
-        }
+    if (ticks & TICK_DIV && (t = timer_next_div(cpu, from)) < next) {
+        next = t;
+    }
+    if (ticks & TICK_TIMA && (t = timer_next_tima(cpu, from)) < next) {
+        next = t;
     }
+    if (ticks & TICK_LCD && (t = lcd_next_change(cpu, from)) < next) {
+        next = t;
+    }
+    return next;
+}
 
-    if (addr == 0xff11) {
-        // NR11
-        cpu->nr11 = v;
-    } else if (addr == 0xff12) {
-        // NR12
-        cpu->nr12 = v;
-    } else if (addr == 0xff13) {
-        // NR13
-        cpu->nr13 = v;
-    } else if (addr == 0xff14) {
-        // NR14
-        cpu->nr14 = v;
-    } else if (addr == 0xff16) {
-        // NR21
-        cpu->nr21 = v;
-    } else if (addr == 0xff17) {
-        // NR22
-        cpu->nr22 = v;
-    } else if (addr == 0xff18) {
-        // NR23
-        cpu->nr23 = v;
-    } else if (addr == 0xff19) {
-        // NR24
-        cpu->nr24 = v;
-    } else if (addr == 0xff1a) {
-        // NR30
-        cpu->nr30 = v;
-    } else if (addr == 0xff1b) {
-        // NR31
-        cpu->nr31 = v;
-    } else if (addr == 0xff1c) {
-        // NR32
-        cpu->nr32 = v;
-    } else if (addr == 0xff1d) {
-        // NR33
-        cpu->nr33 = v;
-    } else if (addr == 0xff1e) {
-        // NR34
-        cpu->nr34 = v;
-    } else if (addr == 0xff20) {
-        // NR41
-        cpu->nr41 = v;
-    } else if (addr == 0xff21) {
-        // NR42
-        cpu->nr42 = v;
-    } else if (addr == 0xff22) {
-        // NR43
-        cpu->nr43 = v;
-    } else if (addr == 0xff23) {
-        // NR44
-        cpu->nr44 = v;
-    } else if (addr == 0xff40) {
-        // LCDC
-        cpu->lcdc = v;
-    } else if (addr == 0xff41) {
-        // STAT
-        // Low 3 bits are R/O.
-        cpu->lcdc_mode = (cpu->lcdc_mode & 0x7) | (v & 0xf8);
-    } else if (addr == 0xff42) {
-        // SCY
-        cpu->lcdc_scy = v;
-    } else if (addr == 0xff43) {
-        // SCX
-        cpu->lcdc_scx = v;
-    } else if (addr == 0xff47) {
-        // BGP
-        cpu->lcdc_bgp = v;
-    } else {
-        cpu->ram[addr] = v;
+// Writes to VRAM and OAM, which aren't in the memory map so that the LCD
+// can draw the lines it's finished with what they showed.
+static void video_set8(cpu_t *cpu, uint16_t addr, uint8_t v) {
+    if (cpu->code_lines[addr >> 6]) {
+        block_invalidate(cpu, addr);
     }
+    lcd_catch_up(cpu);
+    cpu->ram[addr] = v;
 }
 
-uint8_t REG8(cpu_t const *cpu, int s) {
-    switch (s) {
-        case 0x7: return cpu->a;
-        case 0x0: return cpu->b;
-        case 0x1: return cpu->c;
-        case 0x2: return cpu->d;
-        case 0x3: return cpu->e;
-        case 0x4: return cpu->h;
-        case 0x5: return cpu->l;
-        case 0x6: return GET8(cpu, cpu->hl);
-        default:
-            fprintf(stderr, "REG8 got %x\n", s);
-            exit(1);
+uint8_t GET8(cpu_t const *cpu, uint16_t addr) {
+    uint8_t const *page = cpu->read_page[addr >> 8];
+    if (page) {
+        return page[addr & 0xff];
+    } else if (addr >= 0xff00) {
+        return io_get8(cpu, addr);
     }
+    return cpu->cart.read(cpu, addr);
 }
 
-void SREG8(cpu_t *cpu, int s, uint8_t v) {
-    switch (s) {
-        case 0x7: cpu->a = v; break;
-        case 0x0: cpu->b = v; break;
-        case 0x1: cpu->c = v; break;
-        case 0x2: cpu->d = v; break;
-        case 0x3: cpu->e = v; break;
-        case 0x4: cpu->h = v; break;
-        case 0x5: cpu->l = v; break;
-        case 0x6: SET8(cpu, cpu->hl, v); break;
-        default:
-            fprintf(stderr, "SREG8 got %x\n", s);
-            exit(1);
+void SET8(cpu_t *cpu, uint16_t addr, uint8_t v) {
+    uint8_t *page = cpu->write_page[addr >> 8];
+    if (page) {
+        if (cpu->code_lines[addr >> 6]) {
+            block_invalidate(cpu, addr);
+        }
+        page[addr & 0xff] = v;
+    } else if (addr >= 0xff00) {
+        io_set8(cpu, addr, v);
+    } else if ((addr >= 0x8000 && addr < 0xa000) || (addr >> 8) == 0xfe) {
+        video_set8(cpu, addr, v);
+    } else {
+        cpu->cart.write(cpu, addr, v);
     }
 }
 
@@ -305,30 +329,6 @@ char const *REG8N(int s) {
     }
 }
 
-uint16_t REG16(cpu_t *cpu, int s) {
-    switch (s) {
-        case 0x0: return cpu->bc;
-        case 0x1: return cpu->de;
-        case 0x2: return cpu->hl;
-        case 0x3: return cpu->sp;
-        default:
-            fprintf(stderr, "REG16 got %x\n", s);
-            exit(1);
-    }
-}
-
-void SREG16(cpu_t *cpu, int s, uint16_t v) {
-    switch (s) {
-        case 0x0: cpu->bc = v; break;
-        case 0x1: cpu->de = v; break;
-        case 0x2: cpu->hl = v; break;
-        case 0x3: cpu->sp = v; break;
-        default:
-            fprintf(stderr, "SREG16 got %x\n", s);
-            exit(1);
-    }
-}
-
 char const *REG16N(int s) {
     switch (s) {
         case 0x0: return "BC";
@@ -353,757 +353,1326 @@ char const *CCN(int s) {
     }
 }
 
+// Where the two stack bytes at sp and sp + 1 are in host memory, if they
+// can be read as one: both in WRAM or HRAM (or anywhere else mapped), on
+// the same page.  NULL means they go through GET8/SET8.
+static uint8_t const *stack_read(cpu_t const *cpu, uint16_t sp) {
+    if (sp >= 0xff80 && sp < 0xfffe) {
+        return cpu->ram + sp;
+    }
+    uint8_t const *page = cpu->read_page[sp >> 8];
+    return page && (sp & 0xff) != 0xff ? page + (sp & 0xff) : NULL;
+}
+
+// The same for writing, which also needs no cached code under either byte.
+static uint8_t *stack_write(cpu_t *cpu, uint16_t sp) {
+    if (cpu->code_lines[sp >> 6] || cpu->code_lines[(uint16_t) (sp + 1) >> 6]) {
+        return NULL;
+    } else if (sp >= 0xff80 && sp < 0xfffe) {
+        return cpu->ram + sp;
+    }
+    uint8_t *page = cpu->write_page[sp >> 8];
+    return page && (sp & 0xff) != 0xff ? page + (sp & 0xff) : NULL;
+}
+
 void PUSH16(cpu_t *cpu, uint16_t v) {
     cpu->sp -= 2;
-    SET8(cpu, cpu->sp, v & 0xff);
-    SET8(cpu, cpu->sp + 1, (v >> 8) & 0xff);
+    uint8_t *p = stack_write(cpu, cpu->sp);
+    if (p) {
+        p[0] = v & 0xff;
+        p[1] = (v >> 8) & 0xff;
+    } else {
+        SET8(cpu, cpu->sp, v & 0xff);
+        SET8(cpu, cpu->sp + 1, (v >> 8) & 0xff);
+    }
 }
 
 uint16_t POP16(cpu_t *cpu) {
-    uint16_t v = GET8(cpu, cpu->sp + 1);
-    v = (v << 8) | GET8(cpu, cpu->sp);
+    uint8_t const *p = stack_read(cpu, cpu->sp);
+    uint16_t v;
+    if (p) {
+        v = p[1] << 8 | p[0];
+    } else {
+        v = GET8(cpu, cpu->sp + 1);
+        v = (v << 8) | GET8(cpu, cpu->sp);
+    }
     cpu->sp += 2;
     return v;
 }
 
-static int show_dis = 0;
-#define DIS if (show_dis && !cpu->rom_lock)
+#endif
+
+// Disassembles the instruction in the tracing build; compiled out of the
+// normal one.
+#ifdef CPU_TRACE
+#define DIS if (!cpu->rom_lock)
+#else
+#define DIS if (0)
+#endif
+
+// Interrupts are only looked for when IME, IE or IF change.  If one can be
+// taken, cpu_run() is stopped after the current instruction (cpu->stop,
+// and cpu->block_exit for the block cache and JIT code) for run_cycles()
+// to take it.
+static void check_interrupts(cpu_t *cpu) {
+    if (cpu->ime && cpu->ram[0xffff] & cpu->ram[0xff0f] & 0x1f) {
+        cpu->stop = 1;
+        cpu->block_exit = 1;
+    }
+}
 
-struct daa_table_entry {
-    int fc_before;
-    int bit47_low;
-    int bit47_high;
-    int fh_before;
-    int bit03_low;
-    int bit03_high;
-    int add_a;
-    int set_fc;
-};
+// Calls the handler for the first interrupt IE and IF let through, which
+// takes 20 cycles.
+static int take_interrupt(cpu_t *cpu) {
+    int i = __builtin_ctz(cpu->ram[0xffff] & cpu->ram[0xff0f] & 0x1f);
+    DIS { printf("interrupt %02x\n", 0x40 + i * 8); }
+    cpu->ram[0xff0f] &= ~(1 << i);
+    cpu->ime = 0;
+    PUSH16(cpu, cpu->pc);
+    cpu->pc = 0x40 + i * 8;
+    ++cpu->interrupts;
+    cpu->cycles += 20;
+    return 20;
+}
 
-struct daa_table_entry daa_add[9] = {
-    { 0, 0x0, 0x9, 0, 0x0, 0x9, 0x00, 0 },
-    { 0, 0x0, 0x8, 0, 0xa, 0xf, 0x06, 0 },
-    { 0, 0x0, 0x9, 1, 0x0, 0x3, 0x06, 0 },
-    { 0, 0xa, 0xf, 0, 0x0, 0x9, 0x60, 1 },
-    { 0, 0x9, 0xf, 0, 0xa, 0xf, 0x66, 1 },
-    { 0, 0xa, 0xf, 1, 0x0, 0x3, 0x66, 1 },
-    { 1, 0x0, 0x2, 0, 0x0, 0x9, 0x60, 1 },
-    { 1, 0x0, 0x2, 0, 0xa, 0xf, 0x66, 1 },
-    { 1, 0x0, 0x3, 1, 0x0, 0x3, 0x66, 1 },
-};
+// Passes the time while halted: the rest of left, which run_cycles() has
+// made end at the next scheduled event, as that's the soonest anything
+// can request an interrupt.  Returns 0, waking up, once one has been.
+static int halt_wait(cpu_t *cpu, int left) {
+    if (cpu->ram[0xffff] & cpu->ram[0xff0f] & 0x1f) {
+        cpu->halted = 0;
+        return 0;
+    }
+    cpu->cycles += left;
+    cpu->halt_cycles += left;
+    return left;
+}
 
-struct daa_table_entry daa_sub[4] = {
-    { 0, 0x0, 0x9, 0, 0x0, 0x9, 0x00, 0 },
-    { 0, 0x0, 0x8, 1, 0x6, 0xf, 0xfa, 0 },
-    { 1, 0x7, 0xf, 0, 0x0, 0x9, 0xa0, 1 },
-    { 1, 0x6, 0xf, 1, 0x6, 0xf, 0x9a, 1},
-};
+struct opcode ops[256], cb_ops[256];
 
-int step(cpu_t *cpu) {
-    DIS { printf("%04x: ", cpu->pc); }
+static int op_unknown(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    fprintf(stderr, "unknown opcode: %x\n", GET8(cpu, cpu->pc - 1));
+    dump(cpu);
+    return -1;
+}
 
-    uint8_t b = GET8(cpu, cpu->pc++);
+// Register operands are indexed through R8()/R16().  (HL) operands get
+// their own _mhl handlers instead of a test in every access.
 
-    if ((b & 0xc0) == 0x40) {
-        // LD r,r'
-        uint8_t dst = (b >> 3) & 0x7,
-                src = b & 0x7;
-        DIS { printf("LD %s,%s\n", REG8N(dst), REG8N(src)); }
-        SREG8(cpu, dst, REG8(cpu, src));
+static int op_ld_r_r(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD %s,%s\n", REG8N(op->x), REG8N(op->y)); }
+    *R8(cpu, op->x) = *R8(cpu, op->y);
 
-        // no flags set
-        return dst == 0x6 || src == 0x6 ? 8 : 4;
-    } else if ((b & 0xc7) == 0x06) {
-        // LD r,n
-        uint8_t r = (b >> 3) & 0x7;
-        uint8_t v = GET8(cpu, cpu->pc++);
-        DIS { printf("LD %s,$%x\n", REG8N(r), v); }
-        SREG8(cpu, r, v);
-
-        // no flags set
-        return 8;
-    } else if (b == 0x0a) {
-        // LD A,(BC)
-        DIS { printf("LD A,(BC)\n"); }
-        cpu->a = GET8(cpu, cpu->bc);
+    // no flags set
+    return 0;
+}
 
-        // no flags set
-        return 8;
-    } else if (b == 0x1a) {
-        // LD A,(DE)
-        DIS { printf("LD A,(DE)\n"); }
-        cpu->a = GET8(cpu, cpu->de);
+static int op_ld_r_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD %s,(HL)\n", REG8N(op->x)); }
+    *R8(cpu, op->x) = GET8(cpu, cpu->hl);
 
-        // no flags set
-        return 8;
-    } else if (b == 0xe2) {
-        // LD ($FF00+C),A
-        DIS { printf("LD ($FF00+C),A\n"); }
-        SET8(cpu, 0xff00 + cpu->c, cpu->a);
+    // no flags set
+    return 0;
+}
 
-        // no flags set
-        return 8;
-    } else if (b == 0xf0) {
-        // LD A,($FF00+n)
-        uint8_t n = GET8(cpu, cpu->pc++);
-        DIS { printf("LD A,($FF00+$%x)\n", n); }
-        cpu->a = GET8(cpu, 0xff00 + n);
+static int op_ld_mhl_r(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD (HL),%s\n", REG8N(op->y)); }
+    SET8(cpu, cpu->hl, *R8(cpu, op->y));
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_r_n(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD %s,$%x\n", REG8N(op->x), n); }
+    *R8(cpu, op->x) = n;
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_mhl_n(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD (HL),$%x\n", n); }
+    SET8(cpu, cpu->hl, n);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_a_bc(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD A,(BC)\n"); }
+    cpu->a = GET8(cpu, cpu->bc);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_a_de(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD A,(DE)\n"); }
+    cpu->a = GET8(cpu, cpu->de);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_ioc_a(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD ($FF00+C),A\n"); }
+    SET8(cpu, 0xff00 + cpu->c, cpu->a);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_a_ion(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD A,($FF00+$%x)\n", n); }
+    cpu->a = GET8(cpu, 0xff00 + n);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_ion_a(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD ($FF00+$%x),A\n", n); }
+    SET8(cpu, 0xff00 + n, cpu->a);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_a_nn(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD A,($%04x)\n", n); }
+    cpu->a = GET8(cpu, n);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_nn_a(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD ($%04x),A\n", n); }
+    SET8(cpu, n, cpu->a);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_a_hli(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD A,(HL+)\n"); }
+    cpu->a = GET8(cpu, cpu->hl++);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_a_hld(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD A,(HL-)\n"); }
+    cpu->a = GET8(cpu, cpu->hl--);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_bc_a(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD (BC),A\n"); }
+    SET8(cpu, cpu->bc, cpu->a);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_de_a(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD (DE),A\n"); }
+    SET8(cpu, cpu->de, cpu->a);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_hli_a(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD (HL+),A\n"); }
+    SET8(cpu, cpu->hl++, cpu->a);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_hld_a(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD (HL-),A\n"); }
+    SET8(cpu, cpu->hl--, cpu->a);
+
+    // no flags set
+    return 0;
+}
+
+static int op_ld_dd_nn(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD %s,$%04x\n", REG16N(op->x), n); }
+    *R16(cpu, op->x) = n;
+
+    // no flags set
+    return 0;
+}
+
+static int op_push(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("PUSH %s\n", REG16N(op->x)); }
+    PUSH16(cpu, *R16(cpu, op->x));
+
+    // no flags set
+    return 0;
+}
+
+static int op_push_af(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("PUSH AF\n"); }
+    PUSH16(cpu, cpu->a << 8 | flags_get(cpu));
+
+    // no flags set
+    return 0;
+}
+
+static int op_pop(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("POP %s\n", REG16N(op->x)); }
+    *R16(cpu, op->x) = POP16(cpu);
+
+    // no flags set
+    return 0;
+}
+
+static int op_pop_af(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("POP AF\n"); }
+    uint16_t v = POP16(cpu);
+    cpu->a = v >> 8;
+    cpu->f = v & 0xf0;
+    cpu->flags_op = FLAGS_NONE;
+    return 0;
+}
+
+static int op_ld_nn_sp(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("LD ($%04x),SP\n", n); }
+
+    SET8(cpu, n, cpu->sp & 0xff);
+    SET8(cpu, n + 1, cpu->sp >> 8);
+
+    // no flags set
+    return 0;
+}
+
+static void add8(cpu_t *cpu, uint8_t v) {
+    cpu->flags_op = FLAGS_ADD;
+    cpu->flags_a = cpu->a;
+    cpu->flags_b = v;
+    cpu->a += v;
+}
+
+static void cp8(cpu_t *cpu, uint8_t n) {
+    cpu->flags_op = FLAGS_SUB;
+    cpu->flags_a = cpu->a;
+    cpu->flags_b = n;
+}
+
+static void and8(cpu_t *cpu, uint8_t v) {
+    cpu->a &= v;
+    cpu->flags_op = FLAGS_AND;
+    cpu->flags_r = cpu->a;
+}
+
+static void or8(cpu_t *cpu, uint8_t v) {
+    cpu->a |= v;
+    cpu->flags_op = FLAGS_OR;
+    cpu->flags_r = cpu->a;
+}
+
+static void xor8(cpu_t *cpu, uint8_t v) {
+    cpu->a ^= v;
+    cpu->flags_op = FLAGS_OR;
+    cpu->flags_r = cpu->a;
+}
+
+static int op_add_r(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("ADD A,%s\n", REG8N(op->x)); }
+    add8(cpu, *R8(cpu, op->x));
+    return 0;
+}
+
+static int op_add_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("ADD A,(HL)\n"); }
+    add8(cpu, GET8(cpu, cpu->hl));
+    return 0;
+}
+
+static int op_add_n(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("ADD A,$%02x\n", n); }
+    add8(cpu, n);
+    return 0;
+}
+
+static int op_sub_r(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("SUB %s\n", REG8N(op->x)); }
+
+    uint8_t v = *R8(cpu, op->x);
+    cp8(cpu, v);
+    cpu->a -= v;
+    return 0;
+}
+
+static int op_sub_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("SUB (HL)\n"); }
+
+    uint8_t v = GET8(cpu, cpu->hl);
+    cp8(cpu, v);
+    cpu->a -= v;
+    return 0;
+}
+
+static int op_sub_n(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("SUB $%02x\n", n); }
+
+    cp8(cpu, n);
+    cpu->a -= n;
+    return 0;
+}
+
+static int op_and_r(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("AND %s\n", REG8N(op->x)); }
+    and8(cpu, *R8(cpu, op->x));
+    return 0;
+}
+
+static int op_and_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("AND (HL)\n"); }
+    and8(cpu, GET8(cpu, cpu->hl));
+    return 0;
+}
+
+static int op_and_n(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("AND $%02x\n", n); }
+    and8(cpu, n);
+    return 0;
+}
+
+static int op_or_r(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("OR %s\n", REG8N(op->x)); }
+    or8(cpu, *R8(cpu, op->x));
+    return 0;
+}
+
+static int op_or_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("OR (HL)\n"); }
+    or8(cpu, GET8(cpu, cpu->hl));
+    return 0;
+}
+
+static int op_xor_r(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("XOR %s\n", REG8N(op->x)); }
+    xor8(cpu, *R8(cpu, op->x));
+    return 0;
+}
+
+static int op_xor_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("XOR (HL)\n"); }
+    xor8(cpu, GET8(cpu, cpu->hl));
+    return 0;
+}
+
+static int op_cp_r(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("CP %s\n", REG8N(op->x)); }
+    cp8(cpu, *R8(cpu, op->x));
+    return 0;
+}
+
+static int op_cp_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("CP (HL)\n"); }
+    cp8(cpu, GET8(cpu, cpu->hl));
+    return 0;
+}
+
+static int op_cp_n(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("CP $%02x\n", n); }
+    cp8(cpu, n);
+    return 0;
+}
+
+static int op_add_hl_ss(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("ADD HL,%s\n", REG16N(op->x)); }
+    uint16_t v = *R16(cpu, op->x);
+    flags_sync(cpu);
+    cpu->fh = (((v & 0xfff) + (cpu->hl & 0xfff)) & 0x1000) == 0x1000;
+    cpu->fn = 0;
+    cpu->fc = ((uint32_t) v) + ((uint32_t) cpu->hl) > 0xffff;
+    cpu->hl += v;
+    return 0;
+}
+
+// INC and DEC keep C, so it's worked out before the lazy flags move on.
+static uint8_t inc8(cpu_t *cpu, uint8_t v) {
+    cpu->flags_c = flag_c(cpu);
+    cpu->flags_op = FLAGS_INC;
+    cpu->flags_r = v + 1;
+    return cpu->flags_r;
+}
+
+static uint8_t dec8(cpu_t *cpu, uint8_t v) {
+    cpu->flags_c = flag_c(cpu);
+    cpu->flags_op = FLAGS_DEC;
+    cpu->flags_r = v - 1;
+    return cpu->flags_r;
+}
+
+static int op_inc_r(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("INC %s\n", REG8N(op->x)); }
+    uint8_t *r = R8(cpu, op->x);
+    *r = inc8(cpu, *r);
+    return 0;
+}
+
+static int op_inc_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("INC (HL)\n"); }
+    SET8(cpu, cpu->hl, inc8(cpu, GET8(cpu, cpu->hl)));
+    return 0;
+}
+
+static int op_dec_r(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("DEC %s\n", REG8N(op->x)); }
+    uint8_t *r = R8(cpu, op->x);
+    *r = dec8(cpu, *r);
+    return 0;
+}
+
+static int op_dec_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("DEC (HL)\n"); }
+    SET8(cpu, cpu->hl, dec8(cpu, GET8(cpu, cpu->hl)));
+    return 0;
+}
+
+static int op_inc_ss(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("INC %s\n", REG16N(op->x)); }
+    ++*R16(cpu, op->x);
+
+    // no flags set (!)
+    return 0;
+}
+
+static int op_dec_ss(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("DEC %s\n", REG16N(op->x)); }
+    --*R16(cpu, op->x);
+
+    // no flags set
+    return 0;
+}
 
-        // no flags set
+// The rotates and shifts, as functions of the operand.  They set every
+// flag, so the lazy ones are dropped.
+static uint8_t rlc8(cpu_t *cpu, uint8_t v) {
+    cpu->flags_op = FLAGS_NONE;
+    cpu->f = 0;
+    cpu->fc = (v & 0x80) == 0x80;
+
+    v = ((v & 0x7f) << 1) | (v >> 7);
+
+    cpu->fz = v == 0;
+    return v;
+}
+
+static uint8_t rl8(cpu_t *cpu, uint8_t v) {
+    uint8_t old_fc = flag_c(cpu);
+
+    cpu->flags_op = FLAGS_NONE;
+    cpu->f = 0;
+    cpu->fc = (v & 0x80) == 0x80;
+
+    v = ((v & 0x7f) << 1) | old_fc;
+
+    cpu->fz = v == 0;
+    return v;
+}
+
+static uint8_t rrc8(cpu_t *cpu, uint8_t v) {
+    cpu->flags_op = FLAGS_NONE;
+    cpu->f = 0;
+    cpu->fc = (v & 0x1) == 0x1;
+
+    v = ((v & 0xfe) >> 1) | ((v & 0x1) << 7);
+
+    cpu->fz = v == 0;
+    return v;
+}
+
+static uint8_t rr8(cpu_t *cpu, uint8_t v) {
+    uint8_t old_fc = flag_c(cpu);
+
+    cpu->flags_op = FLAGS_NONE;
+    cpu->f = 0;
+    cpu->fc = (v & 0x1) == 0x1;
+
+    v = ((v & 0xfe) >> 1) | (old_fc << 7);
+
+    cpu->fz = v == 0;
+    return v;
+}
+
+static uint8_t sla8(cpu_t *cpu, uint8_t v) {
+    cpu->flags_op = FLAGS_NONE;
+    cpu->f = 0;
+    cpu->fc = (v & 0x80) == 0x80;
+
+    v <<= 1;
+
+    cpu->fz = v == 0;
+    return v;
+}
+
+static uint8_t sra8(cpu_t *cpu, uint8_t v) {
+    cpu->flags_op = FLAGS_NONE;
+    cpu->f = 0;
+    cpu->fc = (v & 0x1) == 0x1;
+
+    v >>= 1;
+    v |= ((v & 0x40) << 1);
+
+    cpu->fz = v == 0;
+    return v;
+}
+
+static uint8_t srl8(cpu_t *cpu, uint8_t v) {
+    cpu->flags_op = FLAGS_NONE;
+    cpu->f = 0;
+    cpu->fc = (v & 0x1) == 0x1;
+
+    v >>= 1;
+
+    cpu->fz = v == 0;
+    return v;
+}
+
+static uint8_t swap8(cpu_t *cpu, uint8_t v) {
+    return (v >> 4) | (v << 4);
+}
+
+static int op_rlca(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("RLCA\n"); }
+    cpu->a = rlc8(cpu, cpu->a);
+    return 0;
+}
+
+static int op_rla(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("RLA\n"); }
+    cpu->a = rl8(cpu, cpu->a);
+    return 0;
+}
+
+static int op_rrca(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("RRCA\n"); }
+    cpu->a = rrc8(cpu, cpu->a);
+    return 0;
+}
+
+static int op_rra(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("RRA\n"); }
+    cpu->a = rr8(cpu, cpu->a);
+    return 0;
+}
+
+static int op_cb(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    struct opcode const *cb = &cb_ops[n];
+    int t = cb->fn(cpu, cb, 0);
+    return t < 0 ? t : cb->cycles + t;
+}
+
+// A CB rotate or shift: op_name on a register and op_name_mhl on (HL).
+#define CB_SHIFT(name, mnemonic) \
+static int op_##name(cpu_t *cpu, struct opcode const *op, uint16_t n) { \
+    DIS { printf(mnemonic " %s\n", REG8N(op->x)); } \
+    uint8_t *r = R8(cpu, op->x); \
+    *r = name##8(cpu, *r); \
+    return 0; \
+} \
+\
+static int op_##name##_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) { \
+    DIS { printf(mnemonic " (HL)\n"); } \
+    SET8(cpu, cpu->hl, name##8(cpu, GET8(cpu, cpu->hl))); \
+    return 0; \
+}
+
+CB_SHIFT(rlc, "RLC")
+CB_SHIFT(rl, "RL")
+CB_SHIFT(rrc, "RRC")
+CB_SHIFT(rr, "RR")
+CB_SHIFT(sla, "SLA")
+CB_SHIFT(sra, "SRA")
+CB_SHIFT(srl, "SRL")
+CB_SHIFT(swap, "SWAP")  // no flags set (!)
+
+#undef CB_SHIFT
+
+static int op_bit(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("BIT %d,%s\n", op->x, REG8N(op->y)); }
+
+    flags_sync(cpu);
+    cpu->fz = ((*R8(cpu, op->y) >> op->x) & 0x1) == 0;
+    cpu->fn = 0;
+    cpu->fh = 1;
+    return 0;
+}
+
+static int op_bit_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("BIT %d,(HL)\n", op->x); }
+
+    flags_sync(cpu);
+    cpu->fz = ((GET8(cpu, cpu->hl) >> op->x) & 0x1) == 0;
+    cpu->fn = 0;
+    cpu->fh = 1;
+    return 0;
+}
+
+static int op_set(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("SET %d,%s\n", op->x, REG8N(op->y)); }
+    *R8(cpu, op->y) |= 1 << op->x;
+    return 0;
+}
+
+static int op_set_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("SET %d,(HL)\n", op->x); }
+    SET8(cpu, cpu->hl, GET8(cpu, cpu->hl) | (1 << op->x));
+    return 0;
+}
+
+static int op_res(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("RES %d,%s\n", op->x, REG8N(op->y)); }
+    *R8(cpu, op->y) &= ~(1 << op->x);
+    return 0;
+}
+
+static int op_res_mhl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("RES %d,(HL)\n", op->x); }
+    SET8(cpu, cpu->hl, GET8(cpu, cpu->hl) & ~(1 << op->x));
+    return 0;
+}
+
+static int op_jp_nn(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("JP $%04x\n", n); }
+    cpu->pc = n;
+    return 0;
+}
+
+static int op_jp_cc_nn(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("JP %s,$%04x\n", CCN(op->x), n); }
+
+    if (flags_cond(cpu, op->x)) {
+        cpu->pc = n;
+        return 4;
+    }
+    return 0;
+}
+
+static int op_jr_e(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    int16_t e = (int16_t) ((int8_t) n) + 2;
+    DIS { printf("JR %d\n", e); }
+    cpu->pc += (-2) + e;
+    return 0;
+}
+
+static int op_jr_cc_e(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    int16_t e = (int16_t) ((int8_t) n) + 2;
+    DIS { printf("JR %s, %d\n", CCN(op->x), e); }
+
+    if (flags_cond(cpu, op->x)) {
+        cpu->pc += (-2) + e;
+        return 4;
+    }
+    return 0;
+}
+
+static int op_jp_hl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("JP (HL)\n"); }
+
+    cpu->pc = cpu->hl;
+    return 0;
+}
+
+static int op_call_nn(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("CALL $%04x\n", n); }
+    PUSH16(cpu, cpu->pc);
+    cpu->pc = n;
+
+    // no flags set
+    return 0;
+}
+
+static int op_call_cc_nn(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("CALL %s,$%04x\n", CCN(op->x), n); }
+
+    if (flags_cond(cpu, op->x)) {
+        PUSH16(cpu, cpu->pc);
+        cpu->pc = n;
         return 12;
-    } else if (b == 0xe0) {
-        // LD ($FF00+n),A
-        uint8_t n = GET8(cpu, cpu->pc++);
-        DIS { printf("LD ($FF00+$%x),A\n", n); }
-        SET8(cpu, 0xff00 + n, cpu->a);
+    }
+
+    // no flags set
+    return 0;
+}
+
+static int op_ret(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("RET\n"); }
+    cpu->pc = POP16(cpu);
 
-        // no flags set
+    // no flags set
+    return 0;
+}
+
+static int op_ret_cc(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("RET %s\n", CCN(op->x)); }
+
+    if (flags_cond(cpu, op->x)) {
+        cpu->pc = POP16(cpu);
         return 12;
+    }
+
+    // no flags set
+    return 0;
+}
+
+static int op_rst(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("RST %d\n", op->x); }
+    PUSH16(cpu, cpu->pc);
+    cpu->pc = op->x * 8;
+    // no flags set
+    return 0;
+}
+
+static int op_daa(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("DAA\n"); }
+
+    uint16_t r = flags_daa[(flags_get(cpu) & 0x70) << 4 | cpu->a];
+    cpu->a = r & 0xff;
+    cpu->f = r >> 8;
+    cpu->flags_op = FLAGS_NONE;
+    return 0;
+}
+
+static int op_cpl(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("CPL\n"); }
+    flags_sync(cpu);
+    cpu->fh = 0;
+    cpu->fn = 0;
+    cpu->a = ~cpu->a;
+    return 0;
+}
+
+static int op_ccf(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("CCF\n"); }
+    flags_sync(cpu);
+    cpu->fn = cpu->fh = 0;
+    cpu->fc = !cpu->fc;
+    return 0;
+}
+
+static int op_scf(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("SCF\n"); }
+    flags_sync(cpu);
+    cpu->fn = cpu->fh = 0;
+    cpu->fc = 1;
+    return 0;
+}
+
+static int op_nop(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("NOP\n"); }
+    // no flags set
+    return 0;
+}
+
+static int op_reti(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("RETI\n"); }
+    cpu->pc = POP16(cpu);
+    cpu->ime = 1;
+    check_interrupts(cpu);
+
+    // no flags set
+    return 0;
+}
+
+static int op_di(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("DI\n"); }
+    cpu->ime = 0;
+    cpu->ei = 0;
+
+    // no flags set
+    return 0;
+}
+
+// HALT sleeps until an interrupt is requested, whether or not IME lets it
+// be taken; run_cycles() skips the time in between.  With IME off and one
+// already requested it doesn't sleep, and the next opcode byte is read
+// twice (the HALT bug).
+static int op_halt(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("HALT\n"); }
+    if (!cpu->ime && cpu->ram[0xffff] & cpu->ram[0xff0f] & 0x1f) {
+        cpu->halt_bug = 1;
+    } else {
+        cpu->halted = 1;
+    }
+    cpu->stop = 1;
+    cpu->block_exit = 1;
+
+    // no flags set
+    return 0;
+}
+
+// IME is set once the next instruction is done, which run_cycles() sees to.
+static int op_ei(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    DIS { printf("EI\n"); }
+    if (!cpu->ime) {
+        cpu->ei = 1;
+        cpu->stop = 1;
+        cpu->block_exit = 1;
+    }
+
+    // no flags set
+    return 0;
+}
+
+#define OP(f, xx, yy, l, t) \
+    (struct opcode) { .fn = (f), .x = (xx), .y = (yy), .len = (l), .cycles = (t) }
+#define JUMP(f, xx, yy, l, t) \
+    (struct opcode) { .fn = (f), .x = (xx), .y = (yy), .len = (l), .cycles = (t), .flags = OP_JUMP }
+#define STORE(f, xx, yy, l, t) \
+    (struct opcode) { .fn = (f), .x = (xx), .y = (yy), .len = (l), .cycles = (t), .flags = OP_STORE }
+#define JUMP_STORE(f, xx, yy, l, t) \
+    (struct opcode) { .fn = (f), .x = (xx), .y = (yy), .len = (l), .cycles = (t), .flags = OP_JUMP | OP_STORE }
+
+// Decoding happens once per opcode, when the tables are built; the order of
+// the tests matters where the bit patterns overlap.
+static struct opcode decode(uint8_t b) {
+    uint8_t r = b & 0x7,
+            r3 = (b >> 3) & 0x7,
+            rr = (b >> 4) & 0x3,
+            cc = (b >> 3) & 0x3;
+
+    if (b == 0x76) {
+        return OP(op_halt, 0, 0, 0, 4);
+    } else if ((b & 0xf8) == 0x70) {
+        return STORE(op_ld_mhl_r, r3, r, 0, 8);
+    } else if ((b & 0xc7) == 0x46) {
+        return OP(op_ld_r_mhl, r3, r, 0, 8);
+    } else if ((b & 0xc0) == 0x40) {
+        return OP(op_ld_r_r, r3, r, 0, 4);
+    } else if (b == 0x36) {
+        return STORE(op_ld_mhl_n, r3, 0, 1, 8);
+    } else if ((b & 0xc7) == 0x06) {
+        return OP(op_ld_r_n, r3, 0, 1, 8);
+    } else if (b == 0x0a) {
+        return OP(op_ld_a_bc, 0, 0, 0, 8);
+    } else if (b == 0x1a) {
+        return OP(op_ld_a_de, 0, 0, 0, 8);
+    } else if (b == 0xe2) {
+        return STORE(op_ld_ioc_a, 0, 0, 0, 8);
+    } else if (b == 0xf0) {
+        return OP(op_ld_a_ion, 0, 0, 1, 12);
+    } else if (b == 0xe0) {
+        return STORE(op_ld_ion_a, 0, 0, 1, 12);
     } else if (b == 0xfa) {
-        // LD A,(nn)
-        uint16_t v = GET8(cpu, cpu->pc++);
-        v |= GET8(cpu, cpu->pc++) << 8;
-        DIS { printf("LD A,($%04x)\n", v); }
-        cpu->a = GET8(cpu, v);
-
-        // no flags set
-        return 16;
+        return OP(op_ld_a_nn, 0, 0, 2, 16);
     } else if (b == 0xea) {
-        // LD (nn),A
-        uint16_t v = GET8(cpu, cpu->pc++);
-        v |= GET8(cpu, cpu->pc++) << 8;
-        DIS { printf("LD ($%04x),A\n", v); }
-        SET8(cpu, v, cpu->a);
-
-        // no flags set
-        return 16;
+        return STORE(op_ld_nn_a, 0, 0, 2, 16);
     } else if (b == 0x2a) {
-        // LD A,(HL+)
-        DIS { printf("LD A,(HL+)\n"); }
-        cpu->a = GET8(cpu, cpu->hl++);
-
-        // no flags set
-        return 8;
+        return OP(op_ld_a_hli, 0, 0, 0, 8);
     } else if (b == 0x3a) {
-        // LD A,(HL-)
-        DIS { printf("LD A,(HL-)\n"); }
-        cpu->a = GET8(cpu, cpu->hl--);
-
-        // no flags set
-        return 8;
+        return OP(op_ld_a_hld, 0, 0, 0, 8);
     } else if (b == 0x02) {
-        // LD (BC),A
-        DIS { printf("LD (BC),A\n"); }
-        SET8(cpu, cpu->bc, cpu->a);
-
-        // no flags set
-        return 8;
+        return STORE(op_ld_bc_a, 0, 0, 0, 8);
     } else if (b == 0x12) {
-        // LD (DE),A
-        DIS { printf("LD (DE),A\n"); }
-        SET8(cpu, cpu->de, cpu->a);
-
-        // no flags set
-        return 8;
+        return STORE(op_ld_de_a, 0, 0, 0, 8);
     } else if (b == 0x22) {
-        // LD (HL+),A
-        DIS { printf("LD (HL+),A\n"); }
-        SET8(cpu, cpu->hl++, cpu->a);
-
-        // no flags set
-        return 8;
+        return STORE(op_ld_hli_a, 0, 0, 0, 8);
     } else if (b == 0x32) {
-        // LD (HL-),A
-        DIS { printf("LD (HL-),A\n"); }
-        SET8(cpu, cpu->hl--, cpu->a);
-
-        // no flags set
-        return 8;
+        return STORE(op_ld_hld_a, 0, 0, 0, 8);
     } else if ((b & 0xcf) == 0x01) {
-        // LD dd,nn
-        uint8_t r = (b >> 4) & 0x3;
-        uint16_t v = GET8(cpu, cpu->pc++);
-        v |= GET8(cpu, cpu->pc++) << 8;
-        DIS { printf("LD %s,$%04x\n", REG16N(r), v); }
-        SREG16(cpu, r, v);
-
-        // no flags set
-        return 12;
+        return OP(op_ld_dd_nn, rr, 0, 2, 12);
+    } else if (b == 0xf5) {
+        return STORE(op_push_af, rr, 0, 0, 16);
     } else if ((b & 0xcf) == 0xc5) {
-        // PUSH qq
-        uint8_t qq = (b >> 4) & 0x3;
-        DIS { printf("PUSH %s\n", REG16N(qq)); }
-        PUSH16(cpu, REG16(cpu, qq));
-
-        // no flags set
-        return 16;
+        return STORE(op_push, rr, 0, 0, 16);
+    } else if (b == 0xf1) {
+        return OP(op_pop_af, rr, 0, 0, 12);
     } else if ((b & 0xcf) == 0xc1) {
-        // POP qq
-        uint8_t qq = (b >> 4) & 0x3;
-        DIS { printf("POP %s\n", REG16N(qq)); }
-        SREG16(cpu, qq, POP16(cpu));
-
-        // no flags set
-        return 12;
+        return OP(op_pop, rr, 0, 0, 12);
     } else if (b == 0x08) {
-        // LD (nn),SP
-        uint16_t v = GET8(cpu, cpu->pc++);
-        v |= GET8(cpu, cpu->pc++) << 8;
-        DIS { printf("LD ($%04x),SP\n", v); }
-
-        SET8(cpu, v, cpu->sp & 0xff);
-        SET8(cpu, v + 1, cpu->sp >> 8);
-
-        // no flags set
-        return 20;
+        return STORE(op_ld_nn_sp, 0, 0, 2, 20);
+    } else if (b == 0x86) {
+        return OP(op_add_mhl, r, 0, 0, 8);
     } else if ((b & 0xf8) == 0x80) {
-        // ADD A,r
-        uint8_t r = b & 0x7;
-        DIS { printf("ADD A,%s\n", REG8N(r)); }
-        uint8_t v = REG8(cpu, r);
-        cpu->fh = (((cpu->a & 0xf) + (v & 0xf)) & 0x10) == 0x10;
-        cpu->fc = ((uint16_t) cpu->a) + ((uint16_t) v) > 0xff;
-        cpu->a += v;
-        cpu->fz = cpu->a == 0;
-        cpu->fn = 0;
-        return r == 0x6 ? 8 : 4;
+        return OP(op_add_r, r, 0, 0, 4);
     } else if (b == 0xc6) {
-        // ADD A,n
-        uint8_t v = GET8(cpu, cpu->pc++);
-        DIS { printf("ADD A,$%02x\n", v); }
-        cpu->fh = (((cpu->a & 0xf) + (v & 0xf)) & 0x10) == 0x10;
-        cpu->fc = ((uint16_t) cpu->a) + ((uint16_t) v) > 0xff;
-        cpu->a += v;
-        cpu->fz = cpu->a == 0;
-        cpu->fn = 0;
-        return 8;
+        return OP(op_add_n, 0, 0, 1, 8);
+    } else if (b == 0x96) {
+        return OP(op_sub_mhl, r, 0, 0, 8);
     } else if ((b & 0xf8) == 0x90) {
-        // SUB r
-        uint8_t r = b & 0x7;
-        DIS { printf("SUB %s\n", REG8N(r)); }
-
-        uint8_t n = REG8(cpu, r);
-        cpu->fz = cpu->a == n;
-        cpu->fn = 1;
-        cpu->fh = (((int) cpu->a & 0xf) - ((int) n & 0xf)) < 0;  // ?
-        cpu->fc = cpu->a > n;
-        cpu->a -= n;
-        return r == 0x6 ? 8 : 4;
+        return OP(op_sub_r, r, 0, 0, 4);
     } else if (b == 0xd6) {
-        // SUB n
-        uint8_t v = GET8(cpu, cpu->pc++);
-        DIS { printf("SUB $%02x\n", v); }
-
-        cpu->fz = cpu->a == v;
-        cpu->fn = 1;
-        cpu->fh = (((int) cpu->a & 0xf) - ((int) v & 0xf)) < 0;  // ?
-        cpu->fc = cpu->a > v;
-        cpu->a -= v;
-        return 8;
+        return OP(op_sub_n, 0, 0, 1, 8);
+    } else if (b == 0xa6) {
+        return OP(op_and_mhl, r, 0, 0, 8);
     } else if ((b & 0xf8) == 0xa0) {
-        // AND r
-        uint8_t r = b & 0x7;
-        DIS { printf("AND %s\n", REG8N(r)); }
-
-        cpu->a &= REG8(cpu, r);
-        cpu->f = 0;
-        cpu->fh = 1;
-        cpu->fz = cpu->a == 0;
-        return r == 0x6 ? 8 : 4;
+        return OP(op_and_r, r, 0, 0, 4);
     } else if (b == 0xe6) {
-        // AND n
-        uint8_t n = GET8(cpu, cpu->pc++);
-        DIS { printf("AND $%02x\n", n); }
-
-        cpu->a &= n;
-        cpu->f = 0;
-        cpu->fh = 1;
-        cpu->fz = cpu->a == 0;
-        return 8;
+        return OP(op_and_n, 0, 0, 1, 8);
+    } else if (b == 0xb6) {
+        return OP(op_or_mhl, r, 0, 0, 8);
     } else if ((b & 0xf8) == 0xb0) {
-        // OR r
-        uint8_t r = b & 0x7;
-        DIS { printf("OR %s\n", REG8N(r)); }
-
-        cpu->a |= REG8(cpu, r);
-        cpu->f = 0;
-        cpu->fz = cpu->a == 0;
-        return r == 0x6 ? 8 : 4;
+        return OP(op_or_r, r, 0, 0, 4);
+    } else if (b == 0xae) {
+        return OP(op_xor_mhl, r, 0, 0, 8);
     } else if ((b & 0xf8) == 0xa8) {
-        // XOR r
-        uint8_t r = b & 0x7;
-        DIS { printf("XOR %s\n", REG8N(r)); }
-        cpu->a = cpu->a ^ REG8(cpu, r);
-
-        cpu->f = 0;
-        cpu->fz = cpu->a == 0;
-        return r == 0x6 ? 8 : 4;
+        return OP(op_xor_r, r, 0, 0, 4);
+    } else if (b == 0xbe) {
+        return OP(op_cp_mhl, r, 0, 0, 8);
     } else if ((b & 0xf8) == 0xb8) {
-        // CP r
-        uint8_t r = b & 0x7;
-        DIS { printf("CP %s\n", REG8N(r)); }
-
-        uint8_t n = REG8(cpu, r);
-        cpu->fz = cpu->a == n;
-        cpu->fn = 1;
-        cpu->fh = (((int) cpu->a & 0xf) - ((int) n & 0xf)) < 0;  // ?
-        cpu->fc = cpu->a > n;
-        return r == 0x6 ? 8 : 4;
+        return OP(op_cp_r, r, 0, 0, 4);
     } else if (b == 0xfe) {
-        // CP n
-        uint8_t n = GET8(cpu, cpu->pc++);
-        DIS { printf("CP $%02x\n", n); }
-
-        cpu->fz = cpu->a == n;
-        cpu->fn = 1;
-        cpu->fh = (((int) cpu->a & 0xf) - ((int) n & 0xf)) < 0;  // ?
-        cpu->fc = cpu->a > n;
-        return 8;
+        return OP(op_cp_n, 0, 0, 1, 8);
     } else if ((b & 0xcf) == 0x09) {
-        // ADD HL,ss
-        uint8_t r = (b >> 4) & 0x3;
-        DIS { printf("ADD HL,%s\n", REG16N(r)); }
-        uint16_t n = REG16(cpu, r);
-        cpu->fh = (((n & 0xfff) + (cpu->hl & 0xfff)) & 0x1000) == 0x1000;
-        cpu->fn = 0;
-        cpu->fc = ((uint32_t) n) + ((uint32_t) cpu->hl) > 0xffff;
-        cpu->hl += n;
-        return 8;
+        return OP(op_add_hl_ss, rr, 0, 0, 8);
+    } else if (b == 0x34) {
+        return STORE(op_inc_mhl, r3, 0, 0, 12);
     } else if ((b & 0xc7) == 0x04) {
-        // INC r
-        uint8_t r = (b >> 3) & 0x7;
-        DIS { printf("INC %s\n", REG8N(r)); }
-        uint8_t v = REG8(cpu, r) + 1;
-        SREG8(cpu, r, v);
-
-        cpu->fz = v == 0;
-        cpu->fn = 0;
-        cpu->fh = v == 0x10;
-        return r == 0x6 ? 12 : 4;
+        return OP(op_inc_r, r3, 0, 0, 4);
+    } else if (b == 0x35) {
+        return STORE(op_dec_mhl, r3, 0, 0, 12);
     } else if ((b & 0xc7) == 0x05) {
-        // DEC r
-        uint8_t r = (b >> 3) & 0x7;
-        DIS { printf("DEC %s\n", REG8N(r)); }
-        uint8_t v = REG8(cpu, r) - 1;
-        SREG8(cpu, r, v);
-
-        cpu->fz = v == 0;
-        cpu->fn = 1;
-        cpu->fh = (v & 0xf) == 0xf;
-        return r == 0x6 ? 12 : 4;
+        return OP(op_dec_r, r3, 0, 0, 4);
     } else if ((b & 0xcf) == 0x03) {
-        // INC ss
-        uint8_t r = (b >> 4) & 0x3;
-        DIS { printf("INC %s\n", REG16N(r)); }
-        uint16_t v = REG16(cpu, r) + 1;
-        SREG16(cpu, r, v);
-
-        // no flags set (!)
-        return 8;
+        return OP(op_inc_ss, rr, 0, 0, 8);
     } else if ((b & 0xcf) == 0x0b) {
-        // DEC ss
-        uint8_t r = (b >> 4) & 0x3;
-        DIS { printf("DEC %s\n", REG16N(r)); }
-        uint16_t v = REG16(cpu, r) - 1;
-        SREG16(cpu, r, v);
-
-        // no flags set
-        return 8;
+        return OP(op_dec_ss, rr, 0, 0, 8);
     } else if (b == 0x07) {
-        // RLCA
-        DIS { printf("RLCA\n"); }
-        uint8_t v = cpu->a;
-        cpu->f = 0;
-        cpu->fc = (v & 0x80) == 0x80;
+        return OP(op_rlca, 0, 0, 0, 4);
+    } else if (b == 0x17) {
+        return OP(op_rla, 0, 0, 0, 4);
+    } else if (b == 0x0f) {
+        return OP(op_rrca, 0, 0, 0, 4);
+    } else if (b == 0x1f) {
+        return OP(op_rra, 0, 0, 0, 4);
+    } else if (b == 0xcb) {
+        // cycles come from cb_ops
+        return STORE(op_cb, 0, 0, 1, 0);
+    } else if (b == 0xc3) {
+        return JUMP(op_jp_nn, 0, 0, 2, 16);
+    } else if ((b & 0xe7) == 0xc2) {
+        return JUMP(op_jp_cc_nn, cc, 0, 2, 12);
+    } else if (b == 0x18) {
+        return JUMP(op_jr_e, 0, 0, 1, 12);
+    } else if ((b & 0xe7) == 0x20) {
+        return JUMP(op_jr_cc_e, cc, 0, 1, 8);
+    } else if (b == 0xe9) {
+        return JUMP(op_jp_hl, 0, 0, 0, 4);
+    } else if (b == 0xcd) {
+        return JUMP_STORE(op_call_nn, 0, 0, 2, 24);
+    } else if ((b & 0xe7) == 0xc4) {
+        return JUMP_STORE(op_call_cc_nn, cc, 0, 2, 8);
+    } else if (b == 0xc9) {
+        return JUMP(op_ret, 0, 0, 0, 16);
+    } else if (b == 0xd9) {
+        return JUMP(op_reti, 0, 0, 0, 16);
+    } else if ((b & 0xe7) == 0xc0) {
+        return JUMP(op_ret_cc, cc, 0, 0, 8);
+    } else if ((b & 0xc7) == 0xc7) {
+        return JUMP_STORE(op_rst, r3, 0, 0, 16);
+    } else if (b == 0x27) {
+        return OP(op_daa, 0, 0, 0, 4);
+    } else if (b == 0x2f) {
+        return OP(op_cpl, 0, 0, 0, 4);
+    } else if (b == 0x3f) {
+        return OP(op_ccf, 0, 0, 0, 4);
+    } else if (b == 0x37) {
+        return OP(op_scf, 0, 0, 0, 4);
+    } else if (b == 0x00) {
+        return OP(op_nop, 0, 0, 0, 4);
+    } else if (b == 0xf3) {
+        return OP(op_di, 0, 0, 0, 4);
+    } else if (b == 0xfb) {
+        return OP(op_ei, 0, 0, 0, 4);
+    }
 
-        v = ((v & 0x7f) << 1) | (v >> 7);
-        cpu->a = v;
+    return JUMP(op_unknown, 0, 0, 0, 0);
+}
 
-        cpu->fz = cpu->a == 0;
-        return 4;
-    } else if (b == 0x17) {
-        // RLA
-        DIS { printf("RLA\n"); }
-        uint8_t v = cpu->a,
-                old_fc = cpu->fc;
-        cpu->f = 0;
-        cpu->fc = (v & 0x80) == 0x80;
+static struct opcode decode_cb(uint8_t b) {
+    uint8_t r = b & 0x7,
+            bit = (b >> 3) & 0x7;
+
+    // Register and (HL) versions of each.
+#define CB(h, xx, yy, t) \
+    (r == 0x6 ? STORE(h##_mhl, xx, yy, 0, t + 8) : OP(h, xx, yy, 0, t))
+
+    if ((b & 0xf8) == 0x00) {
+        return CB(op_rlc, r, 0, 8);
+    } else if ((b & 0xf8) == 0x10) {
+        return CB(op_rl, r, 0, 8);
+    } else if ((b & 0xf8) == 0x08) {
+        return CB(op_rrc, r, 0, 8);
+    } else if ((b & 0xf8) == 0x18) {
+        return CB(op_rr, r, 0, 8);
+    } else if ((b & 0xf8) == 0x20) {
+        return CB(op_sla, r, 0, 8);
+    } else if ((b & 0xf8) == 0x28) {
+        return CB(op_sra, r, 0, 8);
+    } else if ((b & 0xf8) == 0x38) {
+        return CB(op_srl, r, 0, 8);
+    } else if ((b & 0xf8) == 0x30) {
+        return CB(op_swap, r, 0, 8);
+    } else if ((b & 0xc0) == 0x40) {
+        return r == 0x6 ? OP(op_bit_mhl, bit, r, 0, 12) : OP(op_bit, bit, r, 0, 8);
+    } else if ((b & 0xc0) == 0xc0) {
+        return CB(op_set, bit, r, 8);
+    } else {
+        return CB(op_res, bit, r, 8);
+    }
 
-        v = ((v & 0x7f) << 1) | old_fc;
-        cpu->a = v;
+#undef CB
+}
 
-        cpu->fz = cpu->a == 0;
-        return 4;
-    } else if (b == 0x0f) {
-        // RRCA
-        DIS { printf("RRCA\n"); }
-        uint8_t v = cpu->a;
-        cpu->f = 0;
-        cpu->fc = (v & 0x1) == 0x1;
+void ops_init(void) {
+    static int done = 0;
+    if (done) {
+        return;
+    }
 
-        v = ((v & 0xfe) >> 1) | ((v & 0x1) << 7);
-        cpu->a = v;
+    for (int i = 0; i < 256; ++i) {
+        ops[i] = decode(i);
+        cb_ops[i] = decode_cb(i);
+    }
+    done = 1;
+}
 
-        cpu->fz = cpu->a == 0;
-        return 4;
-    } else if (b == 0x1f) {
-        // RRA
-        DIS { printf("RRA\n"); }
-        uint8_t v = cpu->a,
-                old_fc = cpu->fc;
-        cpu->f = 0;
-        cpu->fc = (v & 0x1) == 0x1;
+int step(cpu_t *cpu) {
+    DIS { printf("%04x: ", cpu->pc); }
 
-        v = ((v & 0xfe) >> 1) | (old_fc << 7);
-        cpu->a = v;
+    struct opcode const *op = &ops[GET8(cpu, cpu->pc++)];
 
-        cpu->fz = cpu->a == 0;
-        return 4;
-    } else if (b == 0xcb) {
-        b = GET8(cpu, cpu->pc++);
-        if ((b & 0xf8) == 0x00) {
-            // RLC r
-            uint8_t r = b & 0x7;
-            DIS { printf("RLC %s\n", REG8N(r)); }
-            uint8_t v = REG8(cpu, r);
-            cpu->f = 0;
-            cpu->fc = (v & 0x80) == 0x80;
-
-            v = ((v & 0x7f) << 1) | (v >> 7);
-            SREG8(cpu, r, v);
-
-            cpu->fz = v == 0;
-            return r == 0x6 ? 16 : 8;
-        } else if ((b & 0xf8) == 0x10) {
-            // RL r
-            uint8_t r = b & 0x7;
-            DIS { printf("RL %s\n", REG8N(r)); }
-            uint8_t v = REG8(cpu, r),
-                    old_fc = cpu->fc;
-
-            cpu->f = 0;
-            cpu->fc = (v & 0x80) == 0x80;
-
-            v = ((v & 0x7f) << 1) | old_fc;
-            SREG8(cpu, r, v);
-
-            cpu->fz = v == 0;
-            return r == 0x6 ? 16 : 8;
-        } else if ((b & 0xf8) == 0x08) {
-            // RRC r
-            uint8_t r = b & 0x7;
-            DIS { printf("RRC %s\n", REG8N(r)); }
-            uint8_t v = REG8(cpu, r);
-            cpu->f = 0;
-            cpu->fc = (v & 0x1) == 0x1;
-
-            v = ((v & 0xfe) >> 1) | ((v & 0x1) << 7);
-            SREG8(cpu, r, v);
-
-            cpu->fz = v == 0;
-            return r == 0x6 ? 16 : 8;
-        } else if ((b & 0xf8) == 0x18) {
-            // RR r
-            uint8_t r = b & 0x7;
-            DIS { printf("RR %s\n", REG8N(r)); }
-            uint8_t v = REG8(cpu, r),
-                    old_fc = cpu->fc;
-
-            cpu->f = 0;
-            cpu->fc = (v & 0x1) == 0x1;
-
-            v = ((v & 0xfe) >> 1) | (old_fc << 7);
-            SREG8(cpu, r, v);
-
-            cpu->fz = v == 0;
-            return r == 0x6 ? 16 : 8;
-        } else if ((b & 0xf8) == 0x20) {
-            // SLA r
-            uint8_t r = b & 0x7;
-            DIS { printf("SLA %s\n", REG8N(r)); }
-            uint8_t v = REG8(cpu, r);
-
-            cpu->f = 0;
-            cpu->fc = (v & 0x80) == 0x80;
-            
-            v <<= 1;
-            SREG8(cpu, r, v);
-
-            cpu->fz = v == 0;
-            return r == 0x6 ? 16 : 8;
-        } else if ((b & 0xf8) == 0x28) {
-            // SRA r
-            uint8_t r = b & 0x7;
-            DIS { printf("SRA %s\n", REG8N(r)); }
-            uint8_t v = REG8(cpu, r);
-
-            cpu->f = 0;
-            cpu->fc = (v & 0x1) == 0x1;
-            
-            v >>= 1;
-            v |= ((v & 0x40) << 1);
-            SREG8(cpu, r, v);
-
-            cpu->fz = v == 0;
-            return r == 0x6 ? 16 : 8;
-        } else if ((b & 0xf8) == 0x38) {
-            // SRL r
-            uint8_t r = b & 0x7;
-            DIS { printf("SRL %s\n", REG8N(r)); }
-            uint8_t v = REG8(cpu, r);
-
-            cpu->f = 0;
-            cpu->fc = (v & 0x1) == 0x1;
-            
-            v >>= 1;
-            SREG8(cpu, r, v);
-
-            cpu->fz = v == 0;
-            return r == 0x6 ? 16 : 8;
-        } else if ((b & 0xf8) == 0x30) {
-            // SWAP r
-            uint8_t r = b & 0x7;
-            DIS { printf("SWAP %s\n", REG8N(r)); }
-
-            uint8_t v = REG8(cpu, r);
-            v = (v >> 4) | (v << 4);
-            SREG8(cpu, r, v);
-
-            return r == 0x6 ? 16 : 8;
-        } else if ((b & 0xc0) == 0x40) {
-            // BIT b,r
-            uint8_t bit = (b >> 3) & 0x7,
-                    r = b & 0x7;
-            DIS { printf("BIT %d,%s\n", bit, REG8N(r)); }
-
-            cpu->fz = ((REG8(cpu, r) >> bit) & 0x1) == 0;
-            cpu->fn = 0;
-            cpu->fh = 1;
-            return r == 0x6 ? 12 : 8;
-        } else if ((b & 0xc0) == 0xc0) {
-            // SET b,r
-            uint8_t bit = (b >> 3) & 0x7,
-                    r = b & 0x7;
-            DIS { printf("RES %d,%s\n", bit, REG8N(r)); }
-            SREG8(cpu, r, REG8(cpu, r) | (1 << bit));
-            return r == 0x6 ? 16 : 8;
-        } else if ((b & 0xc0) == 0x80) {
-            // RES b,r
-            uint8_t bit = (b >> 3) & 0x7,
-                    r = b & 0x7;
-            DIS { printf("RES %d,%s\n", bit, REG8N(r)); }
-            SREG8(cpu, r, REG8(cpu, r) & ~(1 << bit));
-            return r == 0x6 ? 16 : 8;
-        } else {
-            fprintf(stderr, "unknown CB opcode: %x\n", b);
-            dump(cpu);
-            return -1;
-        }
-    } else if (b == 0xc3) {
-        // JP nn
-        uint16_t v = GET8(cpu, cpu->pc++);
-        v |= GET8(cpu, cpu->pc++) << 8;
-        DIS { printf("JP $%04x\n", v); }
-        cpu->pc = v;
-        return 16;
-    } else if ((b & 0xe7) == 0xc2) {
-        // JP cc,nn
-        uint8_t cc = (b >> 3) & 0x3;
-        uint16_t v = GET8(cpu, cpu->pc++);
-        v |= GET8(cpu, cpu->pc++) << 8;
-        DIS { printf("JP %s,$%04x\n", CCN(cc), v); }
-
-        int do_jump = 0;
-        switch (cc) {
-            case 0x0: do_jump = !cpu->fz; break;
-            case 0x1: do_jump = cpu->fz; break;
-            case 0x2: do_jump = !cpu->fc; break;
-            case 0x3: do_jump = cpu->fc; break;
-        }
+    uint16_t n = 0;
+    if (op->len > 0) {
+        n = GET8(cpu, cpu->pc++);
+    }
+    if (op->len > 1) {
+        n |= GET8(cpu, cpu->pc++) << 8;
+    }
 
-        if (do_jump) {
-            cpu->pc = v;
-            return 16;
-        }
-        return 12;
-    } else if (b == 0x18) {
-        // JR e
-        int16_t e = (int16_t) ((int8_t) GET8(cpu, cpu->pc++)) + 2;
-        DIS { printf("JR %d\n", e); }
-        cpu->pc += (-2) + e;
-        return 12;
-    } else if ((b & 0xe7) == 0x20) {
-        // JR cc, e
-        uint8_t cc = (b >> 3) & 0x3;
-        int16_t e = (int16_t) ((int8_t) GET8(cpu, cpu->pc++)) + 2;
-        DIS { printf("JR %s, %d\n", CCN(cc), e); }
-
-        int do_jump = 0;
-        switch (cc) {
-            case 0x0: do_jump = !cpu->fz; break;
-            case 0x1: do_jump = cpu->fz; break;
-            case 0x2: do_jump = !cpu->fc; break;
-            case 0x3: do_jump = cpu->fc; break;
-        }
+    int t = op->fn(cpu, op, n);
+    return t < 0 ? t : op->cycles + t;
+}
 
-        if (do_jump) {
-            cpu->pc += (-2) + e;
-            return 12;
-        }
-        return 8;
-    } else if (b == 0xe9) {
-        // JP (HL)
-        DIS { printf("JP (HL)\n"); }
+int step_halt_bug(cpu_t *cpu) {
+    DIS { printf("%04x: ", cpu->pc); }
 
-        cpu->pc = cpu->hl;
-        return 4;
-    } else if (b == 0xcd) {
-        // CALL nn
-        uint16_t v = GET8(cpu, cpu->pc++);
-        v |= GET8(cpu, cpu->pc++) << 8;
-        DIS { printf("CALL $%04x\n", v); }
-        PUSH16(cpu, cpu->pc);
-        cpu->pc = v;
+    struct opcode const *op = &ops[GET8(cpu, cpu->pc)];
 
-        // no flags set
-        return 24;
-    } else if ((b & 0xe7) == 0xc4) {
-        // CALL cc,nn
-        uint8_t cc = (b >> 3) & 0x3;
-        uint16_t v = GET8(cpu, cpu->pc++);
-        v |= GET8(cpu, cpu->pc++) << 8;
-        DIS { printf("CALL %s,$%04x\n", CCN(cc), v); }
-
-        int do_jump = 0;
-        switch (cc) {
-            case 0x0: do_jump = !cpu->fz; break;
-            case 0x1: do_jump = cpu->fz; break;
-            case 0x2: do_jump = !cpu->fc; break;
-            case 0x3: do_jump = cpu->fc; break;
-        }
+    uint16_t n = 0;
+    if (op->len > 0) {
+        n = GET8(cpu, cpu->pc++);
+    }
+    if (op->len > 1) {
+        n |= GET8(cpu, cpu->pc++) << 8;
+    }
 
-        if (do_jump) {
-            PUSH16(cpu, cpu->pc);
-            cpu->pc = v;
-            return 20;
+    int t = op->fn(cpu, op, n);
+    return t < 0 ? t : op->cycles + t;
+}
+
+#if defined(CPU_TRACE)
+
+// trace.c has its own step() loop.
+
+#elif defined(CPU_AOT)
+
+// cpu_run() lives in aot.c.
+
+#elif defined(CPU_BLOCKS)
+
+// cpu_run() lives in block.c.
+
+#elif defined(CPU_THREADED) && defined(__GNUC__)
+
+// Every handler except op_cb, which the threaded loop does inline.
+#define HANDLERS(X) \
+    X(op_unknown) X(op_ld_r_r) X(op_ld_r_mhl) X(op_ld_mhl_r) \
+    X(op_halt) X(op_ld_r_n) X(op_ld_mhl_n) X(op_ld_a_bc) \
+    X(op_ld_a_de) X(op_ld_ioc_a) X(op_ld_a_ion) X(op_ld_ion_a) \
+    X(op_ld_a_nn) X(op_ld_nn_a) X(op_ld_a_hli) X(op_ld_a_hld) \
+    X(op_ld_bc_a) X(op_ld_de_a) X(op_ld_hli_a) X(op_ld_hld_a) \
+    X(op_ld_dd_nn) X(op_push) X(op_push_af) X(op_pop) X(op_pop_af) \
+    X(op_ld_nn_sp) X(op_add_r) X(op_add_mhl) X(op_add_n) X(op_sub_r) \
+    X(op_sub_mhl) X(op_sub_n) X(op_and_r) X(op_and_mhl) X(op_and_n) \
+    X(op_or_r) X(op_or_mhl) X(op_xor_r) X(op_xor_mhl) X(op_cp_r) \
+    X(op_cp_mhl) X(op_cp_n) X(op_add_hl_ss) X(op_inc_r) X(op_inc_mhl) \
+    X(op_dec_r) X(op_dec_mhl) X(op_inc_ss) X(op_dec_ss) X(op_rlca) \
+    X(op_rla) X(op_rrca) X(op_rra) X(op_rlc) X(op_rlc_mhl) X(op_rl) \
+    X(op_rl_mhl) X(op_rrc) X(op_rrc_mhl) X(op_rr) X(op_rr_mhl) X(op_sla) \
+    X(op_sla_mhl) X(op_sra) X(op_sra_mhl) X(op_srl) X(op_srl_mhl) \
+    X(op_swap) X(op_swap_mhl) X(op_bit) X(op_bit_mhl) X(op_set) \
+    X(op_set_mhl) X(op_res) X(op_res_mhl) X(op_jp_nn) X(op_jp_cc_nn) X(op_jr_e) \
+    X(op_jr_cc_e) X(op_jp_hl) X(op_call_nn) X(op_call_cc_nn) X(op_ret) \
+    X(op_ret_cc) X(op_reti) X(op_rst) X(op_daa) X(op_cpl) X(op_ccf) X(op_scf) \
+    X(op_nop) X(op_di) X(op_ei)
+
+// Direct-threaded version of the step() loop: each handler gets its own
+// label, calls it directly (so the compiler can inline it), and jumps
+// straight to the next opcode's label without returning to a loop.  The
+// guest registers stay in cpu_t, where the handlers work on them: with
+// PC kept in a local instead, stored back for each handler, it ran
+// slower (make -C test bench).
+int cpu_run(cpu_t *cpu, int budget) {
+    static void *labels[256], *cb_labels[256];
+
+    if (!labels[0]) {
+        for (int i = 0; i < 256; ++i) {
+#define X(h) \
+            if (ops[i].fn == h) labels[i] = &&L_##h; \
+            if (cb_ops[i].fn == h) cb_labels[i] = &&L_##h;
+            HANDLERS(X)
+#undef X
+            if (ops[i].fn == op_cb) labels[i] = &&L_op_cb;
         }
+    }
 
-        // no flags set
-        return 8;
-    } else if (b == 0xc9) {
-        // RET
-        DIS { printf("RET\n"); }
-        cpu->pc = POP16(cpu);
+    struct opcode const *op;
+    uint16_t n;
+    int t;
+    uint64_t start = cpu->cycles;
+
+#define DISPATCH() \
+    do { \
+        DIS { printf("%04x: ", cpu->pc); } \
+        uint8_t b = GET8(cpu, cpu->pc++); \
+        op = &ops[b]; \
+        n = 0; \
+        if (op->len > 0) { \
+            n = GET8(cpu, cpu->pc++); \
+        } \
+        if (op->len > 1) { \
+            n |= GET8(cpu, cpu->pc++) << 8; \
+        } \
+        goto *labels[b]; \
+    } while (0)
+
+    DISPATCH();
+
+#define X(h) \
+L_##h: \
+    t = h(cpu, op, n); \
+    if (t < 0) { \
+        return t; \
+    } \
+    cpu->cycles += op->cycles + t; \
+    if (cpu->cycles - start >= budget || cpu->stop) { \
+        return cpu->cycles - start; \
+    } \
+    DISPATCH();
+
+    HANDLERS(X)
+#undef X
+
+L_op_cb:
+    op = &cb_ops[n];
+    n = 0;
+    goto *cb_labels[op - cb_ops];
+
+#undef DISPATCH
+}
 
-        // no flags set
-        return 16;
-    } else if ((b & 0xe7) == 0xc0) {
-        // RET cc
-        uint8_t cc = (b >> 3) & 0x3;
-        DIS { printf("RET %s\n", CCN(cc)); }
-
-        int do_jump = 0;
-        switch (cc) {
-            case 0x0: do_jump = !cpu->fz; break;
-            case 0x1: do_jump = cpu->fz; break;
-            case 0x2: do_jump = !cpu->fc; break;
-            case 0x3: do_jump = cpu->fc; break;
-        }
+#else
 
-        if (do_jump) {
-            cpu->pc = POP16(cpu);
-            return 20;
+int cpu_run(cpu_t *cpu, int budget) {
+    int elapsed = 0;
+
+    do {
+        int t = step(cpu);
+        if (t < 0) {
+            return t;
         }
+        elapsed += t;
+        cpu->cycles += t;
+    } while (elapsed < budget && !cpu->stop);
 
-        // no flags set
-        return 8;
-    } else if ((b & 0xc7) == 0xc7) {
-        // RST t
-        uint8_t t = (b >> 3) & 0x7;
-        DIS { printf("RST %d\n", t); }
-        PUSH16(cpu, cpu->pc);
-        cpu->pc = t * 8;
-        // no flags set
-        return 16;
-    } else if (b == 0x27) {
-        // DAA
-        DIS { printf("DAA\n"); }
+    return elapsed;
+}
 
-        cpu->fh = 0;
+#endif
 
-        struct daa_table_entry *table;
-        int tablelen;
-        if (!cpu->fn) {
-            table = daa_add;
-            tablelen = 9;
-        } else {
-            table = daa_sub;
-            tablelen = 4;
+#ifndef CPU_TRACE
+
+// Steps until budget cycles have passed or PC reaches a breakpoint.  The
+// first instruction runs regardless, to get off the breakpoint
+// run_cycles() last stopped at.
+static int step_to_break(cpu_t *cpu, int budget) {
+    int elapsed = 0;
+    do {
+        int t = step(cpu);
+        if (t < 0) {
+            return t;
+        }
+        elapsed += t;
+        cpu->cycles += t;
+    } while (elapsed < budget && !cpu->stop && !cpu_at_break(cpu));
+
+    return elapsed;
+}
+
+int run_cycles(cpu_t *cpu, int budget) {
+    int elapsed = 0;
+    do {
+        // An I/O write can schedule an event sooner, stopping the CPU
+        // (sched_at()), so the budget is cut short here each time round.
+        uint64_t left = cpu->sched.next > cpu->cycles ? cpu->sched.next - cpu->cycles : 0;
+        if (left < (uint64_t) (budget - elapsed)) {
+            budget = elapsed + left;
+        }
+        if (elapsed >= budget) {
+            break;
         }
 
-        uint8_t bit47 = cpu->a >> 4,
-                bit03 = cpu->a & 0xf;
-        int i;
-        for (i = 0; i < tablelen; ++i) {
-            if (
-                cpu->fc == table[i].fc_before &&
-                bit47 >= table[i].bit47_low &&
-                bit47 <= table[i].bit47_high &&
-                cpu->fh == table[i].fh_before &&
-                bit03 >= table[i].bit03_low &&
-                bit03 <= table[i].bit03_high
-            ) {
-                cpu->a += table[i].add_a;
-                cpu->fc = table[i].set_fc;
-                break;
+        int t;
+        cpu->stop = 0;
+        if (cpu->halted) {
+            t = halt_wait(cpu, budget - elapsed);
+        } else if (cpu->ime && cpu->ram[0xffff] & cpu->ram[0xff0f] & 0x1f) {
+            t = take_interrupt(cpu);
+        } else if (cpu->halt_bug) {
+            cpu->halt_bug = 0;
+            t = step_halt_bug(cpu);
+            if (t >= 0) {
+                cpu->cycles += t;
             }
+        } else if (cpu->ei) {
+            // The instruction after EI runs before IME is set, unless
+            // it's a DI.
+            t = cpu->breakpoints ? step_to_break(cpu, 1) : cpu_run(cpu, 1);
+            if (cpu->ei) {
+                cpu->ime = 1;
+                cpu->ei = 0;
+            }
+        } else {
+            t = cpu->breakpoints ? step_to_break(cpu, budget - elapsed) : cpu_run(cpu, budget - elapsed);
         }
+        if (t < 0) {
+            return t;
+        }
+        elapsed += t;
+    } while (elapsed < budget && !cpu_at_break(cpu));
+
+    return elapsed;
+}
 
-        if (i == tablelen) {
-            fprintf(stderr, "DAA hit wall on %02x\n", cpu->a);
+void cpu_break(cpu_t *cpu, uint16_t addr) {
+    if (!cpu->breakpoints) {
+        cpu->breakpoints = calloc(0x10000 / 8, 1);
+        if (!cpu->breakpoints) {
+            fprintf(stderr, "couldn't allocate breakpoints\n");
             exit(1);
         }
-
-        return 4;
-    } else if (b == 0x2f) {
-        // CPL
-        DIS { printf("CPL\n"); }
-        cpu->fh = 0;
-        cpu->fn = 0;
-        cpu->a = ~cpu->a;
-        return 4;
-    } else if (b == 0x3f) {
-        // CCF
-        DIS { printf("CCF\n"); }
-        cpu->fn = cpu->fh = 0;
-        cpu->fc = !cpu->fc;
-        return 4;
-    } else if (b == 0x37) {
-        // SCF
-        DIS { printf("SCF\n"); }
-        cpu->fn = cpu->fh = 0;
-        cpu->fc = 1;
-        return 4;
-    } else if (b == 0x00) {
-        // NOP
-        DIS { printf("NOP\n"); }
-        // no flags set
-        return 4;
-    } else if (b == 0xf3) {
-        // DI
-        DIS { printf("DI\n"); }
-        // no flags set
-        return 4;
-    } else if (b == 0xfb) {
-        // EI
-        DIS { printf("EI\n"); }
-        // no flags set
-        return 4;
     }
+    cpu->breakpoints[addr >> 3] |= 1 << (addr & 7);
+}
 
-    fprintf(stderr, "unknown opcode: %x\n", b);
-    dump(cpu);
-    return -1;
+int cpu_at_break(cpu_t const *cpu) {
+    return cpu->breakpoints && cpu->breakpoints[cpu->pc >> 3] & (1 << (cpu->pc & 7));
 }
 
+#endif
+
 // vim: set sw=4 et:
@@ -1,9 +1,96 @@
 #ifndef CPU_H
 #define CPU_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <time.h>
 
-typedef struct {
+struct cpu;
+
+// Cartridge (cart.c): the ROM and its RAM, the banks mapped in at $0000,
+// $4000 and $A000, and the MBC's registers.  read and write take the
+// accesses the memory map can't: MBC registers, and cart RAM that's
+// disabled or isn't plain bytes.  battery is set for carts whose RAM is
+// kept in a .sav file (save.c), and clock for MBC3 carts with the clock
+// below, which is kept there too.
+struct cart {
+    uint8_t const *rom;
+    uint8_t *ram;
+    int rom_banks;
+    long ram_size;
+    int battery, clock;
+    int mbc;
+    int rom_bank0, rom_bank_selected, ram_bank;
+    int ram_enabled;
+    int mbc_lo, mbc_hi, mbc_mode;
+    uint8_t (*read)(struct cpu const *cpu, uint16_t addr);
+    void (*write)(struct cpu *cpu, uint16_t addr, uint8_t v);
+
+    // MBC3's clock: seconds, minutes, hours, day and day high/flags, as
+    // of rtc_time; the copy latched for reading; and the last value
+    // written to the latch register.
+    uint8_t rtc[5], rtc_latched[5];
+    time_t rtc_time;
+    int rtc_latch;
+};
+
+// Sound registers.
+struct apu {
+    uint8_t nr11, nr12, nr13, nr14;
+    uint8_t nr21, nr22, nr23, nr24;
+    uint8_t nr30, nr31, nr32, nr33, nr34;
+    uint8_t nr41, nr42, nr43, nr44;
+};
+
+// The sound frame sequencer steps at 512 Hz (EVENT_APU).
+#define FRAME_SEQ_CYCLES 8192
+
+// The LCD controller (lcd.c): LCDC, the interrupt enables written to STAT,
+// BGP and the scroll registers.  LY and the mode follow from the cycle
+// count: the frame being drawn started at origin, and drawn of its lines
+// have been handed to draw_line(), which the frontend sets.  Only the
+// interrupts it raises are scheduled (EVENT_LCD).
+struct lcd {
+    uint8_t lcdc;
+    uint8_t stat;
+    uint8_t bgp;
+
+    uint8_t scx, scy;
+
+    uint64_t origin;
+    int drawn;
+    void (*draw_line)(struct cpu *cpu, int line);
+};
+
+// The timer (timer.c).  DIV has counted from div_base, the cycle it was
+// last reset at, and TIMA stood at tima as of tima_base; both are worked
+// out from the cycle count when read.  TIMA overflowing is scheduled
+// (EVENT_TIMER).
+struct timer {
+    uint64_t div_base, tima_base;
+    uint8_t tima, tma, tac;
+};
+
+// Things that happen at a given cycle rather than because of what the CPU
+// does (sched.c).  run() runs the CPU up to the earliest one and then
+// handles it.
+enum event {
+    EVENT_LCD,     // the LCD controller's next interrupt
+    EVENT_APU,     // a step of the sound frame sequencer
+    EVENT_DMA,     // an OAM DMA transfer finishing
+    EVENT_SERIAL,  // a serial transfer finishing
+    EVENT_TIMER,   // TIMA overflowing
+    EVENT_COUNT
+};
+
+// When each event is next due, or SCHED_NEVER; and the earliest of those.
+struct sched {
+    uint64_t at[EVENT_COUNT];
+    uint64_t next;
+};
+
+typedef struct cpu {
     uint8_t a;
     union {
         struct {
@@ -35,27 +122,60 @@ typedef struct {
     };
     uint16_t sp, pc;
 
-    uint8_t rom[0x100], ram[0x10000], *cart;
+    // Lazily evaluated flags (flags.h): the kind of the last flag-setting
+    // op, its operands and result, and the carry INC/DEC keep.
+    int flags_op;
+    uint8_t flags_a, flags_b, flags_r, flags_c;
+
+    uint8_t rom[0x100], ram[0x10000];
 
     int rom_lock;
 
-    int mbc;
+    // Memory map (cpu_map()): where each 256-byte page is in host memory,
+    // or NULL if GET8/SET8 have to handle it.
+    uint8_t const *read_page[0x100];
+    uint8_t *write_page[0x100];
 
-    // MBC3
-    int rom_bank_selected;
+    struct cart cart;
+    struct apu apu;
+    struct lcd lcd;
+    struct timer timer;
+    struct sched sched;
 
-    uint8_t nr11, nr12, nr13, nr14;
-    uint8_t nr21, nr22, nr23, nr24;
-    uint8_t nr30, nr31, nr32, nr33, nr34;
-    uint8_t nr41, nr42, nr43, nr44;
+    // Cycles (at 4 MHz) since power on.  cpu_run() counts them as it
+    // goes, so I/O handlers see the time of the instruction they're in.
+    uint64_t cycles;
+
+    // Set to have cpu_run() return after the current instruction, for
+    // run_cycles() to take an interrupt or finish an EI.
+    int stop;
 
-    int lcdc;
-    int lcdc_mode;
-    int lcdc_modeclock;
-    int lcdc_line;
-    int lcdc_bgp;
+    // The interrupt master enable; whether an EI is waiting for the next
+    // instruction to finish before setting it; whether a HALT is waiting
+    // for an interrupt, or hit the HALT bug; and how many interrupts have
+    // been taken.  IE and IF are in ram[].
+    uint8_t ime, ei;
+    uint8_t halted, halt_bug;
+    long interrupts;
 
-    int lcdc_scx, lcdc_scy;
+    // The keys held down, JOYPAD_* (cpu_joypad()).  P1's select bits are
+    // in ram[].
+    uint8_t joypad;
+
+    // Block cache (block.c).  code_lines marks the 64-byte lines of RAM
+    // that cached blocks were decoded from; block_exit is set when a write
+    // may have changed the code the current block was decoded from, or
+    // the memory map under it.
+    struct block_cache *blocks;
+    uint8_t code_lines[0x10000 >> 6];
+    int block_exit;
+
+    // The cycles skipped over in idle loops (block.c), and halted.
+    long idle_cycles;
+    long halt_cycles;
+
+    // Addresses run_cycles() stops at, a bit each; NULL until one is set.
+    uint8_t *breakpoints;
 } cpu_t;
 
 #define LCDC_BG_ON       (1 << 0)
@@ -66,19 +186,85 @@ typedef struct {
 #define LCDC_WINDOW_AREA (1 << 6)  /* 0: 9800-9bff; 1: 9c00-9fff */
 #define LCDC_OPERATE     (1 << 7)
 
-void cpu_init(cpu_t *cpu, uint8_t const *rom, uint8_t *cart);
+#define STAT_LYC         (1 << 2)
+#define STAT_HBLANK_INT  (1 << 3)
+#define STAT_VBLANK_INT  (1 << 4)
+#define STAT_OAM_INT     (1 << 5)
+#define STAT_LYC_INT     (1 << 6)
+
+// Interrupt sources, by their bit in IE and IF.
+#define INT_VBLANK       (1 << 0)
+#define INT_STAT         (1 << 1)
+#define INT_TIMER        (1 << 2)
+#define INT_SERIAL       (1 << 3)
+#define INT_JOYPAD       (1 << 4)
+
+// The joypad's keys, as P1 reads them: the direction keys, then the
+// buttons.
+#define JOYPAD_RIGHT     (1 << 0)
+#define JOYPAD_LEFT      (1 << 1)
+#define JOYPAD_UP        (1 << 2)
+#define JOYPAD_DOWN      (1 << 3)
+#define JOYPAD_A         (1 << 4)
+#define JOYPAD_B         (1 << 5)
+#define JOYPAD_SELECT    (1 << 6)
+#define JOYPAD_START     (1 << 7)
+
+void cpu_init(cpu_t *cpu, uint8_t const *rom, uint8_t const *cart, long cart_size);
 
 void dump(cpu_t const *cpu);
 
+// Rebuilds the memory map from rom_lock and the cartridge's state, for
+// callers that set those directly rather than through SET8.
+void cpu_map(cpu_t *cpu);
+
+// Copies the 160 bytes the last write to $FF46 (DMA) asked for into OAM.
+// The write schedules EVENT_DMA for when the transfer would be done, and
+// run() calls this then.
+void cpu_dma(cpu_t *cpu);
+
+// Ends the serial transfer the last write to $FF02 started, when
+// EVENT_SERIAL comes due.  Nothing is ever plugged in, so it reads $FF.
+void cpu_serial(cpu_t *cpu);
+
+// Raises the interrupts in bits (INT_*) in IF.
+void cpu_interrupt(cpu_t *cpu, uint8_t bits);
+
+// Sets the keys held down (JOYPAD_*), raising the joypad interrupt if one
+// that P1 has selected went down.
+void cpu_joypad(cpu_t *cpu, uint8_t keys);
+
+// The I/O registers that change as time passes, with no event: DIV and
+// TIMA, and LY and STAT while the LCD is on.  cpu_ticking() gives addr's
+// TICK_* bit if it's one of them, and cpu_next_tick() the first cycle
+// after from at which any of those in ticks changes, or SCHED_NEVER.
+#define TICK_DIV         (1 << 0)
+#define TICK_TIMA        (1 << 1)
+#define TICK_LCD         (1 << 2)
+
+int cpu_ticking(uint16_t addr);
+uint64_t cpu_next_tick(cpu_t const *cpu, int ticks, uint64_t from);
+
 uint8_t GET8(cpu_t const *cpu, uint16_t addr);
 void SET8(cpu_t *cpu, uint16_t addr, uint8_t v);
 
-uint8_t REG8(cpu_t const *cpu, int s);
-void SREG8(cpu_t *cpu, int s, uint8_t v);
-char const *REG8N(int s);
+// Where each register operand lives in cpu_t, by its encoding in the
+// opcode: B, C, D, E, H, L, (HL), A and BC, DE, HL, SP.  (HL) isn't a
+// register; instructions on it have their own handlers.
+static uint8_t const reg8_offset[8] = {
+    offsetof(cpu_t, b), offsetof(cpu_t, c), offsetof(cpu_t, d),
+    offsetof(cpu_t, e), offsetof(cpu_t, h), offsetof(cpu_t, l),
+    0, offsetof(cpu_t, a),
+};
+static uint8_t const reg16_offset[4] = {
+    offsetof(cpu_t, bc), offsetof(cpu_t, de), offsetof(cpu_t, hl),
+    offsetof(cpu_t, sp),
+};
 
-uint16_t REG16(cpu_t *cpu, int s);
-void SREG16(cpu_t *cpu, int s, uint16_t v);
+#define R8(cpu, r) ((uint8_t *) (cpu) + reg8_offset[r])
+#define R16(cpu, r) ((uint16_t *) ((uint8_t *) (cpu) + reg16_offset[r]))
+
+char const *REG8N(int s);
 char const *REG16N(int s);
 
 char const *CCN(int s);
@@ -88,6 +274,35 @@ uint16_t POP16(cpu_t *cpu);
 
 int step(cpu_t *cpu);
 
+// step() for the instruction after a HALT that hit the HALT bug, whose
+// opcode byte is fetched without PC moving past it.
+int step_halt_bug(cpu_t *cpu);
+
+// Runs instructions until at least budget cycles have passed; returns the
+// cycles taken, or -1.  Built on the recompiled ROM (aot.c) when CPU_AOT is
+// defined, the block cache (block.c) with CPU_BLOCKS, the computed-goto
+// dispatcher with CPU_THREADED, and on step() otherwise.
+int cpu_run(cpu_t *cpu, int budget);
+
+// run_cycles() on the tracing build of the core (trace.c), which prints
+// each instruction as it runs it.  Slow; run() switches to it on request.
+int trace_run(cpu_t *cpu, int budget);
+
+// Runs instructions until budget cycles have passed, the next scheduled
+// event is due, or PC reaches a breakpoint other than the one it started
+// on; returns exactly the cycles taken, or -1.  The core's cpu_run() does
+// the work unless there are breakpoints, when it single-steps.  Interrupts
+// are taken here, between cpu_run() calls, whenever a change to IME, IE
+// or IF lets one through (cpu->stop); and a HALT skips straight to the
+// next event.
+int run_cycles(cpu_t *cpu, int budget);
+
+// Sets a breakpoint at addr for run_cycles().
+void cpu_break(cpu_t *cpu, uint16_t addr);
+
+// Whether PC is at a breakpoint.
+int cpu_at_break(cpu_t const *cpu);
+
 #endif
 
 // vim: set sw=4 et:
@@ -1,6 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <SDL.h>
 #include <SDL_opengl.h>
@@ -8,6 +12,11 @@
 #include <fmod_errors.h>
 
 #include "cpu.h"
+#include "fuse.h"
+#include "save.h"
+#include "sched.h"
+#include "timer.h"
+#include "lcd.h"
 
 int run(cpu_t *cpu, SDL_Window *window, FMOD_SYSTEM *system);
 
@@ -35,21 +44,56 @@ void fmod_error_check(FMOD_RESULT result) {
     }
 }
 
-int read_file(char const *filename, uint8_t **out, long *len) {
-    FILE *f = fopen(filename, "r");
-    fseek(f, 0, SEEK_END);
-    *len = ftell(f);
-    fseek(f, 0, SEEK_SET);
+// Maps filename read-only rather than reading it in, so emulators running
+// the same ROM all share the page cache's copy of it.  PREFAULT=1 in the
+// environment faults the whole file in up front instead of as it's first
+// read, and images big enough to fill one are offered huge pages.
+#define HUGE_PAGE_MIN (2 << 20)
+
+uint8_t const *map_file(char const *filename, long *len) {
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror(filename);
+        return NULL;
+    }
 
-    *out = malloc(*len);
-    fread(*out, 1, *len, f);
-    fclose(f);
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        fprintf(stderr, "%s: can't map an empty or unreadable file\n", filename);
+        close(fd);
+        return NULL;
+    }
+    *len = st.st_size;
 
-    return 0;
+    int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+    if (getenv("PREFAULT")) {
+        flags |= MAP_POPULATE;
+    }
+#endif
+    void *p = mmap(NULL, *len, PROT_READ, flags, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        perror(filename);
+        return NULL;
+    }
+
+#ifndef MAP_POPULATE
+    if (getenv("PREFAULT")) {
+        madvise(p, *len, MADV_WILLNEED);
+    }
+#endif
+#ifdef MADV_HUGEPAGE
+    if (*len >= HUGE_PAGE_MIN) {
+        madvise(p, *len, MADV_HUGEPAGE);
+    }
+#endif
+
+    return p;
 }
 
 int main(int argc, char **argv) {
-    uint8_t *rom, *cart;
+    uint8_t const *rom, *cart;
     long romlen, cartlen;
 
     if (argc == 1) {
@@ -57,8 +101,11 @@ int main(int argc, char **argv) {
         return 1;
     }
 
-    read_file("DMG_ROM.bin", &rom, &romlen);
-    read_file(argv[1], &cart, &cartlen);
+    rom = map_file("DMG_ROM.bin", &romlen);
+    cart = map_file(argv[1], &cartlen);
+    if (!rom || !cart) {
+        return 1;
+    }
 
     if (romlen != 256) {
         fprintf(stderr, "ROM not 256 bytes; aborting\n");
@@ -66,7 +113,11 @@ int main(int argc, char **argv) {
     }
 
     cpu_t cpu;
-    cpu_init(&cpu, rom, cart);
+    cpu_init(&cpu, rom, cart, cartlen);
+    munmap((void *) rom, romlen);
+    if (save_open(&cpu, argv[1]) < 0) {
+        return 1;
+    }
 
     SDL_Window *window = SDL_CreateWindow(
         "whynot",
@@ -112,19 +163,44 @@ int main(int argc, char **argv) {
     SDL_DestroyWindow(window);
     SDL_Quit();
 
+    save_close(&cpu);
+    munmap((void *) cart, cartlen);
+
     return retval;
 }
 
-void lcdc_step(cpu_t *cpu, SDL_Window *window, int t);
+void lcdc_init(void);
+void lcdc_draw_line(cpu_t *cpu, int line);
+void lcdc_vblank(cpu_t *cpu, SDL_Window *window);
 void nr_step(cpu_t *cpu, FMOD_SYSTEM *system, int t);
 
 int total_vblanks = 0;
 int did_vblank = 0;
 Uint32 start_ticks = 0;
 
+// When the next blank frame is due while the LCD is off, and the host time
+// spent drawing lines and handling the LCD's events.
+uint64_t blank_at = 0;
+Uint64 ppu_ticks = 0;
+
 FMOD_DSP *nr1_dsp, *nr2_dsp, *nr3_dsp, *nr4_dsp;
 FMOD_CHANNEL *nr1_channel = 0, *nr2_channel = 0, *nr3_channel = 0, *nr4_channel = 0;
 
+// The joypad key (JOYPAD_*) each host key stands for, or 0.
+static uint8_t joypad_key(SDL_Keycode key) {
+    switch (key) {
+        case SDLK_RIGHT:     return JOYPAD_RIGHT;
+        case SDLK_LEFT:      return JOYPAD_LEFT;
+        case SDLK_UP:        return JOYPAD_UP;
+        case SDLK_DOWN:      return JOYPAD_DOWN;
+        case SDLK_x:         return JOYPAD_A;
+        case SDLK_z:         return JOYPAD_B;
+        case SDLK_BACKSPACE: return JOYPAD_SELECT;
+        case SDLK_RETURN:    return JOYPAD_START;
+    }
+    return 0;
+}
+
 int run(cpu_t *cpu, SDL_Window *window, FMOD_SYSTEM *system) {
     dump(cpu);
 
@@ -132,11 +208,23 @@ int run(cpu_t *cpu, SDL_Window *window, FMOD_SYSTEM *system) {
 
     int running = 1;
     int retval = 0;
-    int elapsed = 0;
-    int last_elapsed = 0;
+    long last_idle = 0, last_halt = 0;
+    int last_vblanks = 0;
+    Uint64 last_ppu = 0;
     start_ticks = SDL_GetTicks();
     Uint32 report_ticks = start_ticks;
 
+    // TRACE=1 starts on the tracing core, and F12 switches between the two.
+    int (*run_cpu)(cpu_t *, int) = getenv("TRACE") ? trace_run : run_cycles;
+
+    // BREAK=addr[,addr...] (in hex) switches to the tracing core when PC
+    // first gets to one of them, and dumps the registers each time it does.
+    for (char const *b = getenv("BREAK"); b && *b; ) {
+        char *end;
+        cpu_break(cpu, strtol(b, &end, 16));
+        b = *end == ',' ? end + 1 : "";
+    }
+
     FMOD_System_CreateDSPByType(system, FMOD_DSP_TYPE_OSCILLATOR, &nr1_dsp);
     FMOD_DSP_SetParameterInt(nr1_dsp, FMOD_DSP_OSCILLATOR_TYPE, 1);
     FMOD_System_CreateDSPByType(system, FMOD_DSP_TYPE_OSCILLATOR, &nr2_dsp);
@@ -148,6 +236,10 @@ int run(cpu_t *cpu, SDL_Window *window, FMOD_SYSTEM *system) {
     // use 3D sound, virtual voices, _NRT outputs, streams, callbacks, or
     // FMOD_NONBLOCKING.
 
+    lcdc_init();
+    cpu->lcd.draw_line = lcdc_draw_line;
+    sched_at(cpu, EVENT_APU, cpu->cycles + FRAME_SEQ_CYCLES);
+
     while (running) {
         if (did_vblank) {
             SDL_Event event;
@@ -158,11 +250,20 @@ int run(cpu_t *cpu, SDL_Window *window, FMOD_SYSTEM *system) {
                             break;
                         }
 
-                        // keydown(event.key.keysym.sym);
+                        if (event.key.keysym.sym == SDLK_F12) {
+                            run_cpu = run_cpu == run_cycles ? trace_run : run_cycles;
+                            break;
+                        }
+
+                        if (joypad_key(event.key.keysym.sym)) {
+                            cpu_joypad(cpu, cpu->joypad | joypad_key(event.key.keysym.sym));
+                        }
                         break;
 
                     case SDL_KEYUP:
-                        // keyup(event.key.keysym.sym);
+                        if (joypad_key(event.key.keysym.sym)) {
+                            cpu_joypad(cpu, cpu->joypad & ~joypad_key(event.key.keysym.sym));
+                        }
                         break;
 
                     case SDL_QUIT:
@@ -174,30 +275,75 @@ int run(cpu_t *cpu, SDL_Window *window, FMOD_SYSTEM *system) {
             did_vblank = 0;
         }
 
-        int t = step(cpu);
-        if (t == -1) {
+        // Run up to the next scheduled event in one go; nothing but the
+        // CPU changes anything it can see before then.
+        if (run_cpu(cpu, cpu->sched.next - cpu->cycles) == -1) {
             running = 0;
             retval = 1;
-        } else {
-            elapsed += t;
+        } else if (cpu_at_break(cpu)) {
+            printf("breakpoint at %04x\n", cpu->pc);
+            dump(cpu);
+            run_cpu = trace_run;
         }
 
-        nr_step(cpu, system, t);
-        lcdc_step(cpu, window, t);
+        int ev;
+        uint64_t due;
+        while ((ev = sched_pop(cpu, &due)) >= 0) {
+            switch (ev) {
+                case EVENT_LCD: {
+                    // Lines drawn in here count once, as part of this.
+                    Uint64 ticks = SDL_GetPerformanceCounter(), before = ppu_ticks;
+                    if (lcd_event(cpu, due)) {
+                        lcdc_vblank(cpu, window);
+                    }
+                    ppu_ticks = before + SDL_GetPerformanceCounter() - ticks;
+                    break;
+                }
+
+                case EVENT_APU:
+                    nr_step(cpu, system, FRAME_SEQ_CYCLES);
+                    sched_at(cpu, EVENT_APU, due + FRAME_SEQ_CYCLES);
+                    break;
+
+                case EVENT_DMA:
+                    cpu_dma(cpu);
+                    break;
+
+                case EVENT_SERIAL:
+                    cpu_serial(cpu);
+                    break;
+
+                case EVENT_TIMER:
+                    timer_overflow(cpu, due);
+                    break;
+            }
+        }
+
+        // The LCD does nothing while it's off, but the window still wants
+        // a blank frame, and events polling, once a frame.
+        if (!(cpu->lcd.lcdc & LCDC_OPERATE) && cpu->cycles >= blank_at) {
+            lcdc_vblank(cpu, window);
+        }
 
         Uint32 now = SDL_GetTicks();
         if (report_ticks + 1000 < now) {
             report_ticks += 1000;
-            last_elapsed = elapsed;
-            double secs = ((double) elapsed) / 4194300;
+            double secs = ((double) cpu->cycles) / 4194300;
             double real_elapsed = (double) (SDL_GetTicks() - start_ticks) / 1000;
-            printf("elapsed: %.02f (%0.2f vblank/sec) (real time: %.02f) (%.01f%%)\n", secs, (double) total_vblanks / secs, real_elapsed, secs / real_elapsed * 100.0);
+            int frames = total_vblanks - last_vblanks;
+            double ppu_ms = frames ? (double) (ppu_ticks - last_ppu) * 1000 / SDL_GetPerformanceFrequency() / frames : 0;
+            printf("elapsed: %.02f (%0.2f vblank/sec) (real time: %.02f) (%.01f%%) (idle skipped: %ld cycles/sec) (halted: %ld cycles/sec) (PPU: %.03f ms/frame)\n", secs, (double) total_vblanks / secs, real_elapsed, secs / real_elapsed * 100.0, cpu->idle_cycles - last_idle, cpu->halt_cycles - last_halt, ppu_ms);
+            last_idle = cpu->idle_cycles;
+            last_halt = cpu->halt_cycles;
+            last_vblanks = total_vblanks;
+            last_ppu = ppu_ticks;
         }
     }
 
     if (retval == 0) {
         dump(cpu);
     }
+    fuse_report();
 
     return retval;
 }
@@ -257,15 +403,15 @@ static void envelope(struct sound_props *props, FMOD_CHANNEL *channel, int t) {
 }
 
 void nr_step(cpu_t *cpu, FMOD_SYSTEM *system, int t) {
-    wave_init(&cpu->nr12, &cpu->nr13, &cpu->nr14, system, nr1_dsp, &nr1_channel, &nr1, t);
+    wave_init(&cpu->apu.nr12, &cpu->apu.nr13, &cpu->apu.nr14, system, nr1_dsp, &nr1_channel, &nr1, t);
     envelope(&nr1, nr1_channel, t);
 
-    wave_init(&cpu->nr22, &cpu->nr23, &cpu->nr24, system, nr2_dsp, &nr2_channel, &nr2, t);
+    wave_init(&cpu->apu.nr22, &cpu->apu.nr23, &cpu->apu.nr24, system, nr2_dsp, &nr2_channel, &nr2, t);
     envelope(&nr2, nr2_channel, t);
 
-    if (cpu->nr34 & 0x80) { printf("NR34 init\n"); }
+    if (cpu->apu.nr34 & 0x80) { printf("NR34 init\n"); }
 
-    if (cpu->nr44 & 0x80) {
+    if (cpu->apu.nr44 & 0x80) {
         if (nr4_channel) {
             FMOD_Channel_Stop(nr4_channel);
         }
@@ -274,145 +420,137 @@ void nr_step(cpu_t *cpu, FMOD_SYSTEM *system, int t) {
         nr4.on = 1;
         nr4.elapsed = -t;
 
-        nr4.vol = cpu->nr42 >> 4;
-        nr4.step = 1000 * 64 * (cpu->nr42 & 0x7);  // @4MHz
-        nr4.envelope = (cpu->nr42 & 0x8) == 0x8;
+        nr4.vol = cpu->apu.nr42 >> 4;
+        nr4.step = 1000 * 64 * (cpu->apu.nr42 & 0x7);  // @4MHz
+        nr4.envelope = (cpu->apu.nr42 & 0x8) == 0x8;
     }
 
     envelope(&nr4, nr4_channel, t);
 }
 
-void lcdc_step(cpu_t *cpu, SDL_Window *window, int t) {
-    cpu->lcdc_modeclock += t;
-
-    uint8_t mode = cpu->lcdc_mode & 0x3;
-    uint8_t old_bits = cpu->lcdc_mode & 0xfc;
+// The screen as the LCD draws it, an RGBA pixel each, in palette's shades;
+// and the texture it's shown from, which it's uploaded to through a pixel
+// buffer once a frame.
+static uint32_t framebuffer[SCRH][SCRW];
+static uint32_t shades[4];
+static GLuint screen_texture, screen_pbo;
+
+// Sets up the screen texture, and a projection that scales it up to fill
+// the window.
+void lcdc_init(void) {
+    for (int i = 0; i < 4; ++i) {
+        GLubyte rgba[4] = { palette[i][0], palette[i][1], palette[i][2], 255 };
+        memcpy(&shades[i], rgba, sizeof(rgba));
+    }
+    for (int y = 0; y < SCRH; ++y) {
+        for (int x = 0; x < SCRW; ++x) {
+            framebuffer[y][x] = shades[0];
+        }
+    }
 
-    if (mode == 0 && cpu->lcdc_modeclock >= 204) {
-        // hblank
-        //
-        cpu->lcdc_modeclock = 0;
-        ++cpu->lcdc_line;
+    glGenTextures(1, &screen_texture);
+    glBindTexture(GL_TEXTURE_2D, screen_texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, SCRW, SCRH, 0, GL_RGBA, GL_UNSIGNED_BYTE, framebuffer);
+    glEnable(GL_TEXTURE_2D);
 
-        if (cpu->lcdc_line == 143) {
-            cpu->lcdc_mode = old_bits | 1;  // vblank
-            did_vblank = 1;
-            ++total_vblanks;
+    glGenBuffers(1, &screen_pbo);
 
-            glClearColor(
-                ((float) palette[0][0]) / 255.0f,
-                ((float) palette[0][1]) / 255.0f,
-                ((float) palette[0][2]) / 255.0f,
-                1.0f);
+    glClearColor(
+        ((float) palette[0][0]) / 255.0f,
+        ((float) palette[0][1]) / 255.0f,
+        ((float) palette[0][2]) / 255.0f,
+        1.0f);
 
-            if (!(cpu->lcdc & LCDC_OPERATE)) {
-                glClear(GL_COLOR_BUFFER_BIT);
-            }
+    glViewport(0, 0, SCRW * SCRSCALE, SCRH * SCRSCALE);
 
-            SDL_GL_SwapWindow(window);
+    glMatrixMode(GL_PROJECTION);
+    glLoadIdentity();
+    glOrtho(0, SCRW, SCRH, 0, -1, 1);
 
-            glClear(GL_COLOR_BUFFER_BIT);
+    glMatrixMode(GL_MODELVIEW);
+    glLoadIdentity();
+}
 
-            glViewport(0, 0, SCRW * SCRSCALE, SCRH * SCRSCALE);
+// Shows the frame drawn since the last one: at vblank, or once a frame
+// while the LCD is off, when it's blank.
+void lcdc_vblank(cpu_t *cpu, SDL_Window *window) {
+    did_vblank = 1;
+    ++total_vblanks;
+    blank_at = cpu->cycles + LCD_FRAME_CYCLES;
+
+    if (cpu->lcd.lcdc & LCDC_OPERATE) {
+        // A new store for the buffer each frame, so the copy doesn't wait
+        // for the GPU to be done with the last one; the texture is then
+        // filled from it without the CPU touching it again.
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, screen_pbo);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, sizeof(framebuffer), framebuffer, GL_STREAM_DRAW);
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, SCRW, SCRH, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+        glBegin(GL_QUADS);
+        glTexCoord2i(0, 0);
+        glVertex2i(0, 0);
+        glTexCoord2i(1, 0);
+        glVertex2i(SCRW, 0);
+        glTexCoord2i(1, 1);
+        glVertex2i(SCRW, SCRH);
+        glTexCoord2i(0, 1);
+        glVertex2i(0, SCRH);
+        glEnd();
+    } else {
+        glClear(GL_COLOR_BUFFER_BIT);
+    }
 
-            glMatrixMode(GL_PROJECTION);
-            glLoadIdentity();
-            glOrtho(0, SCRW, SCRH, 0, -1, 1);
+    SDL_GL_SwapWindow(window);
+}
 
-            glMatrixMode(GL_MODELVIEW);
-            glLoadIdentity();
-        } else {
-            cpu->lcdc_mode = old_bits | 2;  // OAM read
-        }
-    } else if (mode == 1 && cpu->lcdc_modeclock >= 456) {
-        // vblank
-        //
-        cpu->lcdc_modeclock = 0;
-        ++cpu->lcdc_line;
-
-        if (cpu->lcdc_line > 153) {
-            cpu->lcdc_mode = old_bits | 2;  // OAM read
-            cpu->lcdc_line = 0;
-        }
-    } else if (mode == 2 && cpu->lcdc_modeclock >= 80) {
-        // OAM read
-        //
-        cpu->lcdc_modeclock = 0;
-        cpu->lcdc_mode = old_bits | 3;  // VRAM read
-    } else if (mode == 3 && cpu->lcdc_modeclock >= 172) {
-        // VRAM read
-        //
-        cpu->lcdc_modeclock = 0;
-        cpu->lcdc_mode = old_bits | 0;  // hblank
-
-        // render scanline
-        
-        if (cpu->lcdc & LCDC_BG_ON) {
-            int offs = (cpu->lcdc & LCDC_BG_AREA) ? 0x9C00 : 0x9800;
-            offs += (((cpu->lcdc_line + cpu->lcdc_scy) & 0xff) >> 3) * 32;
-            int loffs = cpu->lcdc_scx >> 3;
-            int y = (cpu->lcdc_line + cpu->lcdc_scy) & 0x7;
-            int x = cpu->lcdc_scx & 0x7;
-
-            int16_t tile = (int8_t) cpu->ram[offs + loffs];
-            //if ((cpu->lcdc & LCDC_BG_CHAR) && tile < 128) {
-                //tile += 256;
-            //}
-
-            glBegin(GL_QUADS);
-            for (int i = 0; i < 160; ++i) {
-                int base = 0x8000 + (tile << 4) + (y << 1);
-                int sx = 1 << (7 - x);
-                int ci =
-                    (cpu->ram[base] & sx) ? 1 : 0 +
-                    (cpu->ram[base + 1] & sx) ? 2 : 0;
-                ci = (cpu->lcdc_bgp >> (ci * 2)) & 0x3;
-
-                glColor3ubv(palette[ci]);
-
-                glVertex2i(i, cpu->lcdc_line);
-                glVertex2i(i + 1, cpu->lcdc_line);
-                glVertex2i(i + 1, cpu->lcdc_line + 1);
-                glVertex2i(i, cpu->lcdc_line + 1);
-
-                ++x;
-                if (x == 8) {
-                    x = 0;
-                    loffs = (loffs + 1) & 0x1f;
-                    tile = cpu->ram[offs + loffs];
-                    //if ((cpu->lcdc & LCDC_BG_CHAR) && tile < 128) {
-                        //tile += 256;
-                    //}
-                }
+// Renders scanline line, whose VRAM read has finished (lcd.c), into the
+// framebuffer.
+void lcdc_draw_line(cpu_t *cpu, int line) {
+    Uint64 ticks = SDL_GetPerformanceCounter();
+    uint32_t *out = framebuffer[line];
+
+    if (cpu->lcd.lcdc & LCDC_BG_ON) {
+        int offs = (cpu->lcd.lcdc & LCDC_BG_AREA) ? 0x9C00 : 0x9800;
+        offs += (((line + cpu->lcd.scy) & 0xff) >> 3) * 32;
+        int loffs = cpu->lcd.scx >> 3;
+        int y = (line + cpu->lcd.scy) & 0x7;
+        int x = cpu->lcd.scx & 0x7;
+
+        int16_t tile = (int8_t) cpu->ram[offs + loffs];
+        //if ((cpu->lcd.lcdc & LCDC_BG_CHAR) && tile < 128) {
+            //tile += 256;
+        //}
+
+        for (int i = 0; i < SCRW; ++i) {
+            int base = 0x8000 + (tile << 4) + (y << 1);
+            int sx = 1 << (7 - x);
+            int ci =
+                ((cpu->ram[base] & sx) ? 1 : 0) +
+                ((cpu->ram[base + 1] & sx) ? 2 : 0);
+            out[i] = shades[(cpu->lcd.bgp >> (ci * 2)) & 0x3];
+
+            ++x;
+            if (x == 8) {
+                x = 0;
+                loffs = (loffs + 1) & 0x1f;
+                tile = cpu->ram[offs + loffs];
+                //if ((cpu->lcd.lcdc & LCDC_BG_CHAR) && tile < 128) {
+                    //tile += 256;
+                //}
             }
-            glEnd();
         }
-
-        if (cpu->lcdc & LCDC_OBJ_ON) {
-            for (int i = 0; i < 40; ++i) {
-                struct {
-                    uint8_t y;
-                    uint8_t x;
-                    uint8_t tile;
-                    struct {
-                        unsigned int palette : 1;
-                        unsigned int xflip : 1;
-                        unsigned int yflip : 1;
-                        unsigned int prio : 1;
-                        unsigned int unused : 4;
-                    };
-                } *objdata = (void *)&cpu->ram[0xfe00 + i * 4];
-                int y = objdata->y - 16,
-                    x = objdata->x - 8;
-                if (y >= 0) {
-                    printf("%d y = %d x = %d\n", i, y, x);
-                }
-                if (y <= cpu->lcdc_line && (y + 8) > cpu->lcdc_line) {
-                    printf("HIT %d\n", i);
-                }
-            }
+    } else {
+        for (int i = 0; i < SCRW; ++i) {
+            out[i] = shades[0];
         }
     }
+
+    // Objects (LCDC_OBJ_ON) aren't drawn yet.
+
+    ppu_ticks += SDL_GetPerformanceCounter() - ticks;
 }
 
 // vim: set sw=4 et:
@@ -0,0 +1,51 @@
+#include "flags.h"
+
+uint8_t flags_add[0x10000], flags_sub[0x10000];
+uint8_t flags_inc[0x100], flags_dec[0x100];
+uint16_t flags_daa[0x800];
+
+static uint8_t F(int z, int n, int h, int c) {
+    return z << 7 | n << 6 | h << 5 | c << 4;
+}
+
+static uint16_t daa(uint8_t a, int n, int h, int c) {
+    if (!n) {
+        if (c || a > 0x99) {
+            a += 0x60;
+            c = 1;
+        }
+        if (h || (a & 0xf) > 0x9) {
+            a += 0x06;
+        }
+    } else {
+        if (c) {
+            a -= 0x60;
+        }
+        if (h) {
+            a -= 0x06;
+        }
+    }
+    return F(a == 0, n, 0, c) << 8 | a;
+}
+
+void flags_init(void) {
+    static int done = 0;
+    if (done) {
+        return;
+    }
+
+    for (int a = 0; a < 0x100; ++a) {
+        for (int b = 0; b < 0x100; ++b) {
+            flags_add[a << 8 | b] = F(((a + b) & 0xff) == 0, 0, (a & 0xf) + (b & 0xf) > 0xf, a + b > 0xff);
+            flags_sub[a << 8 | b] = F(a == b, 1, (a & 0xf) < (b & 0xf), a < b);
+        }
+        flags_inc[a] = F(a == 0, 0, (a & 0xf) == 0x0, 0);
+        flags_dec[a] = F(a == 0, 1, (a & 0xf) == 0xf, 0);
+    }
+    for (int i = 0; i < 0x800; ++i) {
+        flags_daa[i] = daa(i & 0xff, i >> 10 & 1, i >> 9 & 1, i >> 8 & 1);
+    }
+    done = 1;
+}
+
+// vim: set sw=4 et:
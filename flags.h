@@ -0,0 +1,80 @@
+#ifndef FLAGS_H
+#define FLAGS_H
+
+#include "cpu.h"
+
+// Lazy flag evaluation.  Rather than writing F a bit at a time on every
+// ALU op, the common ops record what they were (cpu->flags_op) along with
+// their operands and result, and the flags are only worked out when
+// something reads them: a conditional jump, PUSH AF, an op that keeps some
+// of the old flags, or anything else that looks at F.  cpu->f is only
+// current when flags_op is FLAGS_NONE; flags_sync() makes it so.
+
+enum {
+    FLAGS_NONE,  /* f holds the flags */
+    FLAGS_ADD,   /* ADD: flags_a + flags_b */
+    FLAGS_SUB,   /* SUB, CP: flags_a - flags_b */
+    FLAGS_AND,   /* AND: result flags_r */
+    FLAGS_OR,    /* OR, XOR: result flags_r */
+    FLAGS_INC,   /* INC r: result flags_r, carry kept in flags_c */
+    FLAGS_DEC,   /* DEC r: result flags_r, carry kept in flags_c */
+};
+
+// F for each operation, indexed by its operands (a << 8 | b) or its
+// result, built by flags_init().  INC and DEC keep C, so theirs is 0.
+// flags_daa gives DAA's result in the low byte and F in the high one,
+// indexed by A and by N, H and C (F >> 4 << 8).
+extern uint8_t flags_add[0x10000], flags_sub[0x10000];
+extern uint8_t flags_inc[0x100], flags_dec[0x100];
+extern uint16_t flags_daa[0x800];
+
+void flags_init(void);
+
+// F as the guest would see it.
+static inline uint8_t flags_get(cpu_t const *cpu) {
+    switch (cpu->flags_op) {
+    case FLAGS_NONE: return cpu->f;
+    case FLAGS_ADD:  return flags_add[cpu->flags_a << 8 | cpu->flags_b];
+    case FLAGS_SUB:  return flags_sub[cpu->flags_a << 8 | cpu->flags_b];
+    case FLAGS_AND:  return cpu->flags_r ? 0x20 : 0xa0;
+    case FLAGS_OR:   return cpu->flags_r ? 0x00 : 0x80;
+    case FLAGS_INC:  return flags_inc[cpu->flags_r] | cpu->flags_c << 4;
+    default:         return flags_dec[cpu->flags_r] | cpu->flags_c << 4;
+    }
+}
+
+static inline int flag_z(cpu_t const *cpu) {
+    return flags_get(cpu) >> 7 & 1;
+}
+
+static inline int flag_n(cpu_t const *cpu) {
+    return flags_get(cpu) >> 6 & 1;
+}
+
+static inline int flag_h(cpu_t const *cpu) {
+    return flags_get(cpu) >> 5 & 1;
+}
+
+static inline int flag_c(cpu_t const *cpu) {
+    return flags_get(cpu) >> 4 & 1;
+}
+
+// Whether condition cc (NZ, Z, NC, C) holds.
+static inline int flags_cond(cpu_t const *cpu, int cc) {
+    switch (cc) {
+        case 0x0: return !flag_z(cpu);
+        case 0x1: return flag_z(cpu);
+        case 0x2: return !flag_c(cpu);
+        default:  return flag_c(cpu);
+    }
+}
+
+// Writes the flags back to cpu->f, for code that works on its bits.
+static inline void flags_sync(cpu_t *cpu) {
+    cpu->f = flags_get(cpu);
+    cpu->flags_op = FLAGS_NONE;
+}
+
+#endif
+
+// vim: set sw=4 et:
@@ -0,0 +1,156 @@
+#include <stdio.h>
+
+#include "cpu.h"
+#include "ops.h"
+#include "block.h"
+#include "flags.h"
+#include "fuse.h"
+
+// Superinstructions for the block cache.  Games spend most of their time
+// in a handful of short loops: counting a register down, copying bytes,
+// and polling an I/O register until it reaches some value.  Each of those
+// runs as a single handler here instead of two or three, saving the
+// dispatches and the flag bookkeeping between them.
+//
+// A fused handler stands for its whole run of instructions, so the block
+// loop only uses it when all but the last of them fit in what's left of
+// the budget, the same place the unfused code would have stopped.  Its
+// entry's pc is the PC after the last instruction, and its cycles are
+// theirs added up; it returns the extra cycles of a taken jump as usual.
+
+enum {
+    FUSE_DEC_JR,
+    FUSE_COPY,
+    FUSE_POLL,
+    FUSE_KINDS,
+};
+
+// With FUSE_STATS, how often each handler runs, for fuse_report().
+#ifdef FUSE_STATS
+static char const *const names[FUSE_KINDS] = {
+    "DEC r; JR NZ,e",
+    "LD A,(HL+); LD (DE),A; INC DE",
+    "LDH A,(n); CP n; JR cc,e",
+};
+
+static unsigned long hits[FUSE_KINDS];
+
+#define COUNT(kind) (++hits[kind])
+#else
+#define COUNT(kind) ((void) 0)
+#endif
+
+#define IS(d, b) ((d).op.fn == ops[b].fn)
+
+// DEC r; JR NZ,e: x is r and n is e.
+static int fuse_dec_jr(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    uint8_t *r = R8(cpu, op->x);
+
+    COUNT(FUSE_DEC_JR);
+    cpu->flags_c = flag_c(cpu);
+    cpu->flags_op = FLAGS_DEC;
+    cpu->flags_r = --*r;
+    if (*r) {
+        cpu->pc += (int8_t) n;
+        return 4;
+    }
+    return 0;
+}
+
+// LD A,(HL+); LD (DE),A; INC DE.  The store happens at the LD (DE),A's
+// time, as I/O and the LCD would see it unfused, so the LD A,(HL+)'s
+// cycles are counted in for it; the block loop adds them up after.  A
+// store into cached code ends the block before the INC, as it would have
+// unfused, leaving PC on it; so the INC's cycles aren't in the entry's and
+// come back as extra cycles instead.
+static int fuse_copy(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    COUNT(FUSE_COPY);
+    cpu->a = GET8(cpu, cpu->hl++);
+    cpu->cycles += ops[0x2a].cycles;
+    SET8(cpu, cpu->de, cpu->a);
+    cpu->cycles -= ops[0x2a].cycles;
+    if (cpu->block_exit) {
+        --cpu->pc;
+        return 0;
+    }
+    ++cpu->de;
+    return 8;
+}
+
+// LDH A,(n); CP m; JR cc,e: n is n | m << 8, x is cc and y is e.
+static int fuse_poll(cpu_t *cpu, struct opcode const *op, uint16_t n) {
+    COUNT(FUSE_POLL);
+    cpu->a = GET8(cpu, 0xff00 + (n & 0xff));
+    cpu->flags_op = FLAGS_SUB;
+    cpu->flags_a = cpu->a;
+    cpu->flags_b = n >> 8;
+    if (flags_cond(cpu, op->x)) {
+        cpu->pc += (int8_t) op->y;
+        return 4;
+    }
+    return 0;
+}
+
+static struct fused *add(struct block *b, int *nfused, struct decoded const *d, int count) {
+    struct fused *f = &b->fused[(*nfused)++];
+
+    f->count = count;
+    f->pre_cycles = 0;
+    f->d.op = (struct opcode) { .cycles = 0 };
+    for (int i = 0; i < count; ++i) {
+        if (i < count - 1) {
+            f->pre_cycles += d[i].op.cycles;
+        }
+        f->d.op.cycles += d[i].op.cycles;
+        f->d.op.flags |= d[i].op.flags;
+    }
+    f->d.n = 0;
+    f->d.pc = d[count - 1].pc;
+    f->d.fused = NULL;
+    return f;
+}
+
+void fuse_block(struct block *b) {
+    int nfused = 0;
+
+    for (int i = 0; i < b->count; ++i) {
+        struct decoded *d = &b->code[i];
+        int left = b->count - i;
+        struct fused *f = NULL;
+
+        if (left >= 2 && IS(d[0], 0x05) && IS(d[1], 0x20) && d[1].op.x == 0) {
+            f = add(b, &nfused, d, 2);
+            f->d.op.fn = fuse_dec_jr;
+            f->d.op.x = d[0].op.x;
+            f->d.n = d[1].n;
+        } else if (left >= 3 && IS(d[0], 0x2a) && IS(d[1], 0x12) &&
+                   IS(d[2], 0x13) && d[2].op.x == 1) {
+            f = add(b, &nfused, d, 3);
+            f->d.op.fn = fuse_copy;
+            f->d.op.cycles = f->pre_cycles;
+        } else if (left >= 3 && IS(d[0], 0xf0) && IS(d[1], 0xfe) && IS(d[2], 0x20)) {
+            f = add(b, &nfused, d, 3);
+            f->d.op.fn = fuse_poll;
+            f->d.op.x = d[2].op.x;
+            f->d.op.y = d[2].n;
+            f->d.n = d[0].n | d[1].n << 8;
+        }
+
+        if (f) {
+            d->fused = f;
+            i += f->count - 1;
+        }
+    }
+}
+
+void fuse_report(void) {
+#ifdef FUSE_STATS
+    for (int i = 0; i < FUSE_KINDS; ++i) {
+        if (hits[i]) {
+            printf("fused %s: %lu\n", names[i], hits[i]);
+        }
+    }
+#endif
+}
+
+// vim: set sw=4 et:
@@ -0,0 +1,16 @@
+#ifndef FUSE_H
+#define FUSE_H
+
+#include "block.h"
+
+// Looks for idioms in a freshly decoded block and points the instruction
+// starting each at a handler that does all of it (see block.h).
+void fuse_block(struct block *b);
+
+// Prints how often each fused handler has run, in builds with FUSE_STATS
+// (Makefile).
+void fuse_report(void);
+
+#endif
+
+// vim: set sw=4 et:
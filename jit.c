@@ -0,0 +1,813 @@
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "cpu.h"
+#include "ops.h"
+#include "block.h"
+#include "jit.h"
+#include "flags.h"
+
+// x86-64 translation of hot blocks.
+//
+// A compiled block is a function int f(cpu_t *cpu) that runs the whole
+// block, leaves cpu->pc pointing at the next instruction and returns the
+// cycles spent, exactly as the interpreter would have counted them.  It's
+// only entered when the block can't overrun the caller's budget (see
+// cpu_run()), so the budget isn't checked along the way; but cpu->cycles
+// is brought up to date before each call out that could reach an I/O
+// register, and on the way out.
+//
+// While inside, the guest registers live in callee-saved host registers:
+//
+//   A  r15d    F  ebp    BC r12d    DE r13d    HL r14d    SP ebx
+//
+// each zero-extended, so C calls (GET8/SET8) leave them alone.  The cpu
+// pointer is kept at [rsp].  Loads and stores, register moves, 8-bit
+// arithmetic, 16-bit INC/DEC, the stack and control flow are translated
+// directly, with memory accesses calling GET8/SET8 (PUSH16/POP16 for the
+// stack).  Everything else (the CB page, ADD HL, rotates, DAA, ...)
+// writes the registers back and calls the interpreter's handler.  Any
+// write that sets cpu->block_exit (self-modifying code, bank switches)
+// returns to the interpreter straight after it.
+
+#if defined(CPU_JIT) && defined(__x86_64__)
+
+#define JIT_SIZE (8 << 20)
+#define JIT_BLOCK_MAX 8192  /* well over the worst case for one block */
+
+enum { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R12 = 12, R13, R14, R15 };
+
+enum { CC_B = 0x2, CC_Z = 0x4, CC_NZ = 0x5, CC_A = 0x7, CC_S = 0x8 };
+
+static uint8_t *buf, *p;
+static int full;
+
+static void emit8(int b) {
+    *p++ = b;
+}
+
+static void emit16(int v) {
+    emit8(v);
+    emit8(v >> 8);
+}
+
+static void emit32(uint32_t v) {
+    emit16(v);
+    emit16(v >> 16);
+}
+
+static void emit64(uint64_t v) {
+    emit32(v);
+    emit32(v >> 32);
+}
+
+// force gets a REX prefix out even when it's empty, for spl/bpl/sil/dil.
+static void rex(int w, int r, int b, int force) {
+    int v = 0x40 | (w << 3) | ((r >> 3) << 2) | (b >> 3);
+    if (v != 0x40 || force) {
+        emit8(v);
+    }
+}
+
+static void modrm(int mod, int reg, int rm) {
+    emit8((mod << 6) | ((reg & 7) << 3) | (rm & 7));
+}
+
+static void mov_rr(int dst, int src) {
+    rex(0, src, dst, 0);
+    emit8(0x89);
+    modrm(3, src, dst);
+}
+
+static void movzx8(int dst, int src) {
+    rex(0, dst, src, src >= 4);
+    emit8(0x0f);
+    emit8(0xb6);
+    modrm(3, dst, src);
+}
+
+static void mov_ri(int dst, uint32_t imm) {
+    rex(0, 0, dst, 0);
+    emit8(0xb8 + (dst & 7));
+    emit32(imm);
+}
+
+static void mov_ri64(int dst, uint64_t imm) {
+    rex(1, 0, dst, 0);
+    emit8(0xb8 + (dst & 7));
+    emit64(imm);
+}
+
+// op: 0 add, 1 or, 4 and, 5 sub, 6 xor, 7 cmp
+static void alu_ri(int op, int dst, uint32_t imm) {
+    rex(0, 0, dst, 0);
+    emit8(0x81);
+    modrm(3, op, dst);
+    emit32(imm);
+}
+
+// opcode: 0x09 or, 0x21 and, 0x31 xor, 0x85 test
+static void alu_rr(int opcode, int dst, int src) {
+    rex(0, src, dst, 0);
+    emit8(opcode);
+    modrm(3, src, dst);
+}
+
+static void shl(int dst, int n) {
+    rex(0, 0, dst, 0);
+    emit8(0xc1);
+    modrm(3, 4, dst);
+    emit8(n);
+}
+
+static void shr(int dst, int n) {
+    rex(0, 0, dst, 0);
+    emit8(0xc1);
+    modrm(3, 5, dst);
+    emit8(n);
+}
+
+static void incdec16(int dec, int r) {
+    emit8(0x66);
+    rex(0, 0, r, 0);
+    emit8(0xff);
+    modrm(3, dec, r);
+}
+
+static void setcc(int cc, int r) {
+    rex(0, 0, r, r >= 4);
+    emit8(0x0f);
+    emit8(0x90 + cc);
+    modrm(3, 0, r);
+}
+
+static void test_ri(int r, uint32_t imm) {
+    rex(0, 0, r, 0);
+    emit8(0xf7);
+    modrm(3, 0, r);
+    emit32(imm);
+}
+
+// mov reg, [rsp]
+static void load_cpu(int r) {
+    rex(1, r, 0, 0);
+    emit8(0x8b);
+    modrm(0, r, RSP);
+    emit8(0x24);
+}
+
+static void store8(int base, int disp, int r) {
+    rex(0, r, base, r >= 4);
+    emit8(0x88);
+    modrm(2, r, base);
+    emit32(disp);
+}
+
+static void store16(int base, int disp, int r) {
+    emit8(0x66);
+    rex(0, r, base, 0);
+    emit8(0x89);
+    modrm(2, r, base);
+    emit32(disp);
+}
+
+static void store16i(int base, int disp, int imm) {
+    emit8(0x66);
+    rex(0, 0, base, 0);
+    emit8(0xc7);
+    modrm(2, 0, base);
+    emit32(disp);
+    emit16(imm);
+}
+
+static void load8(int r, int base, int disp) {
+    rex(0, r, base, 0);
+    emit8(0x0f);
+    emit8(0xb6);
+    modrm(2, r, base);
+    emit32(disp);
+}
+
+static void load16(int r, int base, int disp) {
+    rex(0, r, base, 0);
+    emit8(0x0f);
+    emit8(0xb7);
+    modrm(2, r, base);
+    emit32(disp);
+}
+
+static void movzx16(int dst, int src) {
+    rex(0, dst, src, 0);
+    emit8(0x0f);
+    emit8(0xb7);
+    modrm(3, dst, src);
+}
+
+static void push(int r) {
+    rex(0, 0, r, 0);
+    emit8(0x50 + (r & 7));
+}
+
+static void pop(int r) {
+    rex(0, 0, r, 0);
+    emit8(0x58 + (r & 7));
+}
+
+static void call(void const *fn) {
+    mov_ri64(RAX, (uintptr_t) fn);
+    emit8(0xff);
+    emit8(0xd0);
+}
+
+static void jmp(uint8_t const *to) {
+    emit8(0xe9);
+    emit32(to - (p + 4));
+}
+
+// add qword [base + disp], imm
+static void add64_mi(int base, int disp, int32_t imm) {
+    rex(1, 0, base, 0);
+    emit8(0x81);
+    modrm(2, 0, base);
+    emit32(disp);
+    emit32(imm);
+}
+
+// add qword [base + disp], r
+static void add64_mr(int base, int disp, int r) {
+    rex(1, r, base, 0);
+    emit8(0x01);
+    modrm(2, r, base);
+    emit32(disp);
+}
+
+static void jcc(int cc, uint8_t const *to) {
+    emit8(0x0f);
+    emit8(0x80 + cc);
+    emit32(to - (p + 4));
+}
+
+// Forward jcc; returns the spot for patch().
+static uint8_t *jcc_fwd(int cc) {
+    emit8(0x0f);
+    emit8(0x80 + cc);
+    emit32(0);
+    return p;
+}
+
+static void patch(uint8_t *after) {
+    uint32_t rel = p - after;
+    memcpy(after - 4, &rel, 4);
+}
+
+// Guest register storage.
+
+static void spill(void) {
+    load_cpu(RDI);
+    store8(RDI, offsetof(cpu_t, a), R15);
+    store8(RDI, offsetof(cpu_t, f), RBP);
+    store16(RDI, offsetof(cpu_t, bc), R12);
+    store16(RDI, offsetof(cpu_t, de), R13);
+    store16(RDI, offsetof(cpu_t, hl), R14);
+    store16(RDI, offsetof(cpu_t, sp), RBX);
+}
+
+static void reload(void) {
+    load_cpu(RDI);
+    load8(R15, RDI, offsetof(cpu_t, a));
+    load8(RBP, RDI, offsetof(cpu_t, f));
+    load16(R12, RDI, offsetof(cpu_t, bc));
+    load16(R13, RDI, offsetof(cpu_t, de));
+    load16(R14, RDI, offsetof(cpu_t, hl));
+    load16(RBX, RDI, offsetof(cpu_t, sp));
+}
+
+// The host register holding r (in REG8 numbering) and whether r is its
+// high byte.
+static int host8(int r, int *high) {
+    static int const hosts[8] = { R12, R12, R13, R13, R14, R14, -1, R15 };
+    *high = r < 6 && !(r & 1);
+    return hosts[r];
+}
+
+// eax = r
+static void get8(int r) {
+    int high, h = host8(r, &high);
+    if (high) {
+        mov_rr(RAX, h);
+        shr(RAX, 8);
+    } else {
+        movzx8(RAX, h);
+    }
+}
+
+// r = eax, which must be zero-extended; clobbers eax.
+static void set8(int r) {
+    int high, h = host8(r, &high);
+    if (h == R15) {
+        mov_rr(R15, RAX);
+    } else if (high) {
+        alu_ri(4, h, 0x00ff);
+        shl(RAX, 8);
+        alu_rr(0x09, h, RAX);
+    } else {
+        alu_ri(4, h, 0xff00);
+        alu_rr(0x09, h, RAX);
+    }
+}
+
+static int const host16[4] = { R12, R13, R14, RBX };
+
+// The cycle count.  op_start is where the instruction being emitted
+// starts, in cycles from the start of the block, and counted how much of
+// that has been added to cpu->cycles on the way to here.
+
+static int op_start, counted;
+
+// Brings cpu->cycles up to the start of the current instruction, for a
+// call out.  Code that branches does this first, so both ways agree.
+static void sync_cycles(void) {
+    if (counted != op_start) {
+        load_cpu(RDI);
+        add64_mi(RDI, offsetof(cpu_t, cycles), op_start - counted);
+        counted = op_start;
+    }
+}
+
+// Exits.  Every compiled block starts with its own copy of these, so the
+// body can jump backwards to them.
+
+static uint8_t *epilogue, *epilogue_spill, *error_exit;
+
+// Leaves with cpu->pc = pc, having spent cycles.
+static void exit_to(int pc, int cycles) {
+    load_cpu(RDI);
+    store16i(RDI, offsetof(cpu_t, pc), pc);
+    add64_mi(RDI, offsetof(cpu_t, cycles), cycles - counted);
+    mov_ri(RAX, cycles);
+    jmp(epilogue_spill);
+}
+
+// Leaves with cpu->pc = eax.
+static void exit_to_eax(int cycles) {
+    load_cpu(RDI);
+    store16(RDI, offsetof(cpu_t, pc), RAX);
+    add64_mi(RDI, offsetof(cpu_t, cycles), cycles - counted);
+    mov_ri(RAX, cycles);
+    jmp(epilogue_spill);
+}
+
+static void exit_if_block_exit(int pc, int cycles) {
+    load_cpu(RAX);
+    emit8(0x83);
+    modrm(2, 7, RAX);
+    emit32(offsetof(cpu_t, block_exit));
+    emit8(0);
+    uint8_t *skip = jcc_fwd(CC_Z);
+    exit_to(pc, cycles);
+    patch(skip);
+}
+
+static void emit_exits(void) {
+    epilogue_spill = p;
+    spill();
+    epilogue = p;
+    rex(1, 0, RSP, 0);
+    emit8(0x83);
+    modrm(3, 0, RSP);
+    emit8(24);
+    pop(R15);
+    pop(R14);
+    pop(R13);
+    pop(R12);
+    pop(RBP);
+    pop(RBX);
+    emit8(0xc3);
+
+    error_exit = p;
+    mov_ri(RAX, -1);
+    jmp(epilogue);
+}
+
+static void emit_entry(void) {
+    push(RBX);
+    push(RBP);
+    push(R12);
+    push(R13);
+    push(R14);
+    push(R15);
+    rex(1, 0, RSP, 0);
+    emit8(0x83);
+    modrm(3, 5, RSP);
+    emit8(24);
+
+    rex(1, RDI, 0, 0);
+    emit8(0x89);
+    modrm(0, RDI, RSP);
+    emit8(0x24);
+
+    reload();
+}
+
+// Memory access through GET8/SET8, address in esi.
+
+static void read_mem(void) {
+    sync_cycles();
+    load_cpu(RDI);
+    call(GET8);
+    movzx8(RAX, RAX);
+}
+
+// Writes edx to [esi].
+static void write_mem(void) {
+    sync_cycles();
+    load_cpu(RDI);
+    call(SET8);
+}
+
+// z flag (bit 7) from eax into ebp, which the caller has cleared of it.
+static void set_flag_z(void) {
+    alu_rr(0x31, RCX, RCX);
+    alu_rr(0x85, RAX, RAX);
+    setcc(CC_Z, RCX);
+    shl(RCX, 7);
+    alu_rr(0x09, RBP, RCX);
+}
+
+// The 8-bit operand r, (HL) included, into eax.
+static void operand(int r) {
+    if (r == 6) {
+        mov_rr(RSI, R14);
+        read_mem();
+    } else {
+        get8(r);
+    }
+}
+
+// A = A + eax, as add8().
+static void add_a(void) {
+    mov_rr(RCX, R15);
+    alu_ri(4, RCX, 0xf);
+    mov_rr(RDX, RAX);
+    alu_ri(4, RDX, 0xf);
+    alu_rr(0x01, RCX, RDX);
+    alu_ri(4, RCX, 0x10);
+    shl(RCX, 1);
+    alu_rr(0x01, R15, RAX);
+    mov_rr(RDX, R15);
+    shr(RDX, 8);
+    shl(RDX, 4);
+    alu_ri(4, R15, 0xff);
+    alu_ri(4, RBP, 0x0f);
+    alu_rr(0x09, RBP, RCX);
+    alu_rr(0x09, RBP, RDX);
+    mov_rr(RAX, R15);
+    set_flag_z();
+}
+
+// Flags for A - eax, as cp8(); SUB also stores the result.
+static void cp_a(int sub) {
+    static int const bits[3][2] = { { CC_Z, 7 }, { CC_B, 4 }, { CC_B, 5 } };
+
+    alu_ri(4, RBP, 0x0f);
+    alu_ri(1, RBP, 0x40);
+    mov_rr(RDX, R15);
+    mov_rr(RSI, RAX);
+    for (int i = 0; i < 3; ++i) {
+        if (i == 2) {
+            alu_ri(4, RDX, 0xf);
+            alu_ri(4, RSI, 0xf);
+        }
+        alu_rr(0x31, RCX, RCX);
+        alu_rr(0x39, RDX, RSI);
+        setcc(bits[i][0], RCX);
+        shl(RCX, bits[i][1]);
+        alu_rr(0x09, RBP, RCX);
+    }
+    if (sub) {
+        alu_rr(0x29, R15, RAX);
+        alu_ri(4, R15, 0xff);
+    }
+}
+
+// PUSH16 of host register r, or of imm if r < 0.  PUSH16 takes SP from
+// cpu_t and does the same arithmetic on it as here.
+static void push16(int r, int imm) {
+    sync_cycles();
+    if (r < 0) {
+        mov_ri(RSI, imm);
+    } else {
+        mov_rr(RSI, r);
+    }
+    load_cpu(RDI);
+    store16(RDI, offsetof(cpu_t, sp), RBX);
+    call(PUSH16);
+    incdec16(1, RBX);
+    incdec16(1, RBX);
+}
+
+// POP16 into eax.
+static void pop16(void) {
+    sync_cycles();
+    load_cpu(RDI);
+    store16(RDI, offsetof(cpu_t, sp), RBX);
+    call(POP16);
+    movzx16(RAX, RAX);
+    incdec16(0, RBX);
+    incdec16(0, RBX);
+}
+
+// Jumps forward, to be patched, unless condition cc (as in cond()) holds.
+static uint8_t *jump_unless(int cc) {
+    test_ri(RBP, cc < 2 ? 0x80 : 0x10);
+    return jcc_fwd(cc & 1 ? CC_Z : CC_NZ);
+}
+
+// The handlers leave flags lazy; native code wants them in cpu->f.
+static void sync_flags(cpu_t *cpu) {
+    flags_sync(cpu);
+}
+
+// Falls back on the interpreter's handler for d.
+static void emit_generic(struct decoded const *d, int cycles, int last) {
+    sync_cycles();
+    spill();
+    store16i(RDI, offsetof(cpu_t, pc), d->pc);
+    mov_ri64(RSI, (uintptr_t) &d->op);
+    mov_ri(RDX, d->n);
+    call(d->op.fn);
+    alu_rr(0x85, RAX, RAX);
+    jcc(CC_S, error_exit);
+
+    if (last && d->op.flags & OP_JUMP) {
+        // The handler has set cpu->pc and the registers are in memory.
+        alu_ri(0, RAX, cycles);
+        load_cpu(RDI);
+        add64_mr(RDI, offsetof(cpu_t, cycles), RAX);
+        add64_mi(RDI, offsetof(cpu_t, cycles), -counted);
+        jmp(epilogue);
+        return;
+    }
+
+    load_cpu(RDI);
+    call(sync_flags);
+    reload();
+    exit_if_block_exit(d->pc, cycles);
+}
+
+#define IS(d, b) ((d)->op.fn == ops[b].fn)
+
+// Emits d; cycles includes d's own base cycles.  Returns 1 if d ended the
+// block with its own exit.
+static int emit_op(struct decoded const *d, int cycles, int last) {
+    int x = d->op.x, y = d->op.y;
+
+    if (IS(d, 0x00)) {
+        // NOP
+        return 0;
+    } else if (IS(d, 0x40) || IS(d, 0x46)) {
+        // LD r,r' / LD r,(HL)
+        operand(y);
+        set8(x);
+        return 0;
+    } else if (IS(d, 0x70)) {
+        // LD (HL),r
+        operand(y);
+        mov_rr(RDX, RAX);
+        mov_rr(RSI, R14);
+        write_mem();
+        exit_if_block_exit(d->pc, cycles);
+        return 0;
+    } else if (IS(d, 0x06) || IS(d, 0x36)) {
+        // LD r,n / LD (HL),n
+        if (IS(d, 0x36)) {
+            mov_rr(RSI, R14);
+            mov_ri(RDX, d->n);
+            write_mem();
+            exit_if_block_exit(d->pc, cycles);
+        } else {
+            mov_ri(RAX, d->n);
+            set8(x);
+        }
+        return 0;
+    } else if (IS(d, 0x0a) || IS(d, 0x1a) || IS(d, 0x2a) || IS(d, 0x3a) ||
+               IS(d, 0xfa) || IS(d, 0xf0)) {
+        // LD A,(BC) / LD A,(DE) / LD A,(HL+) / LD A,(HL-) / LD A,(nn) /
+        // LD A,($FF00+n)
+        if (IS(d, 0xfa) || IS(d, 0xf0)) {
+            mov_ri(RSI, IS(d, 0xf0) ? 0xff00 + d->n : d->n);
+        } else {
+            mov_rr(RSI, IS(d, 0x0a) ? R12 : IS(d, 0x1a) ? R13 : R14);
+        }
+        read_mem();
+        mov_rr(R15, RAX);
+        if (IS(d, 0x2a) || IS(d, 0x3a)) {
+            incdec16(IS(d, 0x3a), R14);
+        }
+        return 0;
+    } else if (IS(d, 0x02) || IS(d, 0x12) || IS(d, 0x22) || IS(d, 0x32) ||
+               IS(d, 0xea) || IS(d, 0xe0) || IS(d, 0xe2)) {
+        // LD (BC),A / LD (DE),A / LD (HL+),A / LD (HL-),A / LD (nn),A /
+        // LD ($FF00+n),A / LD ($FF00+C),A
+        if (IS(d, 0xea) || IS(d, 0xe0)) {
+            mov_ri(RSI, IS(d, 0xe0) ? 0xff00 + d->n : d->n);
+        } else if (IS(d, 0xe2)) {
+            movzx8(RSI, R12);
+            alu_ri(0, RSI, 0xff00);
+        } else {
+            mov_rr(RSI, IS(d, 0x02) ? R12 : IS(d, 0x12) ? R13 : R14);
+        }
+        mov_rr(RDX, R15);
+        write_mem();
+        if (IS(d, 0x22) || IS(d, 0x32)) {
+            incdec16(IS(d, 0x32), R14);
+        }
+        exit_if_block_exit(d->pc, cycles);
+        return 0;
+    } else if (IS(d, 0x01)) {
+        // LD dd,nn
+        mov_ri(host16[x], d->n);
+        return 0;
+    } else if (IS(d, 0x03) || IS(d, 0x0b)) {
+        // INC ss / DEC ss
+        incdec16(IS(d, 0x0b), host16[x]);
+        return 0;
+    } else if (IS(d, 0x80) || IS(d, 0x86) || IS(d, 0xc6)) {
+        // ADD A,r / ADD A,(HL) / ADD A,n
+        if (IS(d, 0xc6)) {
+            mov_ri(RAX, d->n);
+        } else {
+            operand(x);
+        }
+        add_a();
+        return 0;
+    } else if (IS(d, 0x90) || IS(d, 0x96) || IS(d, 0xd6) ||
+               IS(d, 0xb8) || IS(d, 0xbe) || IS(d, 0xfe)) {
+        // SUB r / SUB (HL) / SUB n / CP r / CP (HL) / CP n
+        if (IS(d, 0xd6) || IS(d, 0xfe)) {
+            mov_ri(RAX, d->n);
+        } else {
+            operand(x);
+        }
+        cp_a(IS(d, 0x90) || IS(d, 0x96) || IS(d, 0xd6));
+        return 0;
+    } else if (IS(d, 0xa0) || IS(d, 0xa6) || IS(d, 0xe6) || IS(d, 0xb0) ||
+               IS(d, 0xb6) || IS(d, 0xa8) || IS(d, 0xae)) {
+        // AND r / AND (HL) / AND n / OR r / OR (HL) / XOR r / XOR (HL)
+        int or = IS(d, 0xb0) || IS(d, 0xb6), xor = IS(d, 0xa8) || IS(d, 0xae);
+        if (IS(d, 0xe6)) {
+            mov_ri(RAX, d->n);
+        } else {
+            operand(x);
+        }
+        alu_rr(or ? 0x09 : xor ? 0x31 : 0x21, R15, RAX);
+        mov_rr(RAX, R15);
+        alu_rr(0x31, RBP, RBP);
+        set_flag_z();
+        if (!or && !xor) {
+            alu_ri(1, RBP, 0x20);
+        }
+        return 0;
+    } else if (IS(d, 0x04) || IS(d, 0x05)) {
+        // INC r / DEC r: C and the low nibble are kept.
+        int dec = IS(d, 0x05);
+        get8(x);
+        alu_ri(dec ? 5 : 0, RAX, 1);
+        alu_ri(4, RAX, 0xff);
+        alu_ri(4, RBP, 0x1f);
+        if (dec) {
+            alu_ri(1, RBP, 0x40);
+        }
+        set_flag_z();
+        mov_rr(RDX, RAX);
+        alu_ri(4, RDX, 0xf);
+        alu_rr(0x31, RCX, RCX);
+        alu_ri(7, RDX, dec ? 0xf : 0);
+        setcc(CC_Z, RCX);
+        shl(RCX, 5);
+        alu_rr(0x09, RBP, RCX);
+        set8(x);
+        return 0;
+    } else if (IS(d, 0xc5)) {
+        // PUSH qq
+        push16(host16[x], 0);
+        exit_if_block_exit(d->pc, cycles);
+        return 0;
+    } else if (IS(d, 0xc1)) {
+        // POP qq
+        pop16();
+        mov_rr(host16[x], RAX);
+        return 0;
+    } else if (IS(d, 0xc3) || IS(d, 0x18) || IS(d, 0xcd) || IS(d, 0xc7)) {
+        // JP nn / JR e / CALL nn / RST n
+        uint16_t to = IS(d, 0x18) ? d->pc + (int8_t) d->n : IS(d, 0xc7) ? x * 8 : d->n;
+        if (IS(d, 0xcd) || IS(d, 0xc7)) {
+            push16(-1, d->pc);
+        }
+        exit_to(to, cycles);
+        return 1;
+    } else if (IS(d, 0xc2) || IS(d, 0x20) || IS(d, 0xc4)) {
+        // JP cc,nn / JR cc,e / CALL cc,nn
+        uint16_t to = IS(d, 0x20) ? d->pc + (int8_t) d->n : d->n;
+        if (IS(d, 0xc4)) {
+            sync_cycles();
+        }
+        uint8_t *skip = jump_unless(x);
+        if (IS(d, 0xc4)) {
+            push16(-1, d->pc);
+        }
+        exit_to(to, cycles + (IS(d, 0xc4) ? 12 : 4));
+        patch(skip);
+        exit_to(d->pc, cycles);
+        return 1;
+    } else if (IS(d, 0xc9) || IS(d, 0xe9)) {
+        // RET / JP (HL)
+        if (IS(d, 0xc9)) {
+            pop16();
+        } else {
+            mov_rr(RAX, R14);
+        }
+        exit_to_eax(cycles);
+        return 1;
+    } else if (IS(d, 0xc0)) {
+        // RET cc
+        sync_cycles();
+        uint8_t *skip = jump_unless(x);
+        pop16();
+        exit_to_eax(cycles + 12);
+        patch(skip);
+        exit_to(d->pc, cycles);
+        return 1;
+    }
+
+    emit_generic(d, cycles, last);
+    return last && d->op.flags & OP_JUMP;
+}
+
+int (*jit_compile(struct block const *b))(cpu_t *cpu) {
+    if (!buf) {
+        int prot = PROT_READ | PROT_WRITE | PROT_EXEC;
+        int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_JIT
+        flags |= MAP_JIT;
+#endif
+        buf = mmap(NULL, JIT_SIZE, prot, flags, -1, 0);
+        if (buf == MAP_FAILED) {
+            perror("mmap");
+            exit(1);
+        }
+        p = buf;
+    }
+
+    if (p + JIT_BLOCK_MAX > buf + JIT_SIZE) {
+        full = 1;
+        return NULL;
+    }
+
+    emit_exits();
+    int (*fn)(cpu_t *) = (int (*)(cpu_t *)) p;
+    emit_entry();
+
+    int cycles = 0, done = 0;
+    counted = 0;
+    for (int i = 0; i < b->count && !done; ++i) {
+        op_start = cycles;
+        cycles += b->code[i].op.cycles;
+        done = emit_op(&b->code[i], cycles, i == b->count - 1);
+    }
+    if (!done) {
+        exit_to(b->code[b->count - 1].pc, cycles);
+    }
+
+    return fn;
+}
+
+int jit_full(void) {
+    return full;
+}
+
+void jit_reset(void) {
+    p = buf;
+    full = 0;
+}
+
+#elif defined(CPU_JIT)
+
+// No code generator for this host: everything stays interpreted.
+
+int (*jit_compile(struct block const *b))(cpu_t *cpu) {
+    return NULL;
+}
+
+int jit_full(void) {
+    return 0;
+}
+
+void jit_reset(void) {
+}
+
+#endif
+
+// vim: set sw=4 et:
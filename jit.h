@@ -0,0 +1,21 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include "cpu.h"
+#include "block.h"
+
+// Blocks that have run this many times get compiled to native code.
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 32
+#endif
+
+// Compiles b, returning NULL once the code buffer is full; jit_full() then
+// stays true until jit_reset(), which throws away all compiled code.
+// Callers must block_flush() first so nothing still points into it.
+int (*jit_compile(struct block const *b))(cpu_t *cpu);
+int jit_full(void);
+void jit_reset(void);
+
+#endif
+
+// vim: set sw=4 et:
@@ -0,0 +1,217 @@
+#include "cpu.h"
+#include "sched.h"
+#include "lcd.h"
+
+// The LCD controller, which isn't stepped through its modes but worked out
+// from the cycle count.  While it's on, line 0 of the frame being drawn
+// started at lcd.origin; each line takes LINE_CYCLES, the visible ones
+// reading OAM for the first OAM_CYCLES and VRAM for the next VRAM_CYCLES,
+// then sitting in hblank.  LY and STAT are computed when read.  A line is
+// only drawn (lcd.draw_line) once its VRAM read is over and something is
+// about to change what it shows: a write to LCDC, the scroll registers,
+// BGP, VRAM or OAM, or the end of the frame.  What's scheduled (EVENT_LCD)
+// is just the next interrupt: vblank, or a STAT interrupt that's enabled.
+// With the LCD off none of this happens; LY stays at 0 and STAT in hblank.
+
+#define LINE_CYCLES  456
+#define OAM_CYCLES   80
+#define VRAM_CYCLES  172
+#define HBLANK_X     (OAM_CYCLES + VRAM_CYCLES)
+#define VBLANK_LINE  143
+#define FRAME_LINES  154
+
+static int lcd_on(cpu_t const *cpu) {
+    return cpu->lcd.lcdc & LCDC_OPERATE;
+}
+
+// Cycles into the frame at cycle when.  Between vblank starting and the
+// next frame, origin is already that frame's start, in the future.
+static uint32_t frame_pos(cpu_t const *cpu, uint64_t when) {
+    return (when - cpu->lcd.origin + LCD_FRAME_CYCLES) % LCD_FRAME_CYCLES;
+}
+
+static int mode_at(uint32_t pos) {
+    uint32_t x = pos % LINE_CYCLES;
+
+    if (pos / LINE_CYCLES >= VBLANK_LINE) {
+        return 1;
+    }
+    return x < OAM_CYCLES ? 2 : x < HBLANK_X ? 3 : 0;
+}
+
+// Cycles from frame position pos to the next time, after it, that the
+// frame is at position at.
+static uint32_t until(uint32_t pos, uint32_t at) {
+    return (at + LCD_FRAME_CYCLES - pos - 1) % LCD_FRAME_CYCLES + 1;
+}
+
+// Cycles from frame position pos to the next time a visible line is x
+// cycles in.
+static uint32_t until_visible(uint32_t pos, uint32_t x) {
+    uint32_t line = pos / LINE_CYCLES;
+    uint32_t at = line * LINE_CYCLES + x;
+
+    if (at <= pos) {
+        at += LINE_CYCLES;
+        ++line;
+    }
+    if (line >= VBLANK_LINE) {
+        at = LCD_FRAME_CYCLES + x;
+    }
+    return at - pos;
+}
+
+static void draw_lines(cpu_t *cpu, int to) {
+    for (; cpu->lcd.drawn < to; ++cpu->lcd.drawn) {
+        if (cpu->lcd.draw_line) {
+            cpu->lcd.draw_line(cpu, cpu->lcd.drawn);
+        }
+    }
+}
+
+// Schedules EVENT_LCD for the first interrupt after cycle from.
+static void schedule(cpu_t *cpu, uint64_t from) {
+    if (!lcd_on(cpu)) {
+        sched_cancel(cpu, EVENT_LCD);
+        return;
+    }
+
+    uint32_t pos = frame_pos(cpu, from);
+    uint32_t wait = until(pos, VBLANK_LINE * LINE_CYCLES);
+    uint32_t w;
+
+    if (cpu->lcd.stat & STAT_HBLANK_INT && (w = until_visible(pos, HBLANK_X)) < wait) {
+        wait = w;
+    }
+    if (cpu->lcd.stat & STAT_OAM_INT && (w = until_visible(pos, 0)) < wait) {
+        wait = w;
+    }
+    if (cpu->lcd.stat & STAT_LYC_INT && cpu->ram[0xff45] < FRAME_LINES &&
+        (w = until(pos, cpu->ram[0xff45] * LINE_CYCLES)) < wait) {
+        wait = w;
+    }
+    sched_at(cpu, EVENT_LCD, from + wait);
+}
+
+void lcd_init(cpu_t *cpu) {
+    // Line 0's VRAM read has just finished, without drawing anything.
+    cpu->lcd.origin = cpu->cycles - HBLANK_X;
+    cpu->lcd.drawn = 1;
+    schedule(cpu, cpu->cycles);
+}
+
+void lcd_catch_up(cpu_t *cpu) {
+    if (!lcd_on(cpu)) {
+        return;
+    }
+
+    int64_t since = cpu->cycles - cpu->lcd.origin;
+    if (since >= HBLANK_X) {
+        int64_t done = (since - HBLANK_X) / LINE_CYCLES + 1;
+        draw_lines(cpu, done < VBLANK_LINE ? done : VBLANK_LINE);
+    }
+}
+
+int lcd_event(cpu_t *cpu, uint64_t due) {
+    uint32_t pos = frame_pos(cpu, due);
+    uint32_t line = pos / LINE_CYCLES, x = pos % LINE_CYCLES;
+    uint8_t ints = 0;
+    int vblank = 0;
+
+    lcd_catch_up(cpu);
+
+    if (pos == VBLANK_LINE * LINE_CYCLES) {
+        draw_lines(cpu, VBLANK_LINE);
+        cpu->lcd.origin += LCD_FRAME_CYCLES;
+        cpu->lcd.drawn = 0;
+        vblank = 1;
+        ints |= INT_VBLANK;
+        if (cpu->lcd.stat & STAT_VBLANK_INT) {
+            ints |= INT_STAT;
+        }
+    } else if (line < VBLANK_LINE) {
+        if ((x == 0 && cpu->lcd.stat & STAT_OAM_INT) ||
+            (x == HBLANK_X && cpu->lcd.stat & STAT_HBLANK_INT)) {
+            ints |= INT_STAT;
+        }
+    }
+    if (x == 0 && line == cpu->ram[0xff45] && cpu->lcd.stat & STAT_LYC_INT) {
+        ints |= INT_STAT;
+    }
+    if (ints) {
+        cpu_interrupt(cpu, ints);
+    }
+
+    schedule(cpu, due);
+    return vblank;
+}
+
+uint64_t lcd_next_change(cpu_t const *cpu, uint64_t from) {
+    if (!lcd_on(cpu)) {
+        return SCHED_NEVER;
+    }
+
+    uint32_t pos = frame_pos(cpu, from);
+    uint32_t x = pos % LINE_CYCLES;
+    uint32_t next = LINE_CYCLES;
+
+    if (pos / LINE_CYCLES < VBLANK_LINE) {
+        next = x < OAM_CYCLES ? OAM_CYCLES : x < HBLANK_X ? HBLANK_X : LINE_CYCLES;
+    }
+    return from + next - x;
+}
+
+void lcd_set_lcdc(cpu_t *cpu, uint8_t v) {
+    lcd_catch_up(cpu);
+    uint8_t was = cpu->lcd.lcdc;
+    cpu->lcd.lcdc = v;
+
+    if ((was ^ v) & LCDC_OPERATE) {
+        // Switched on, it starts again from line 0.
+        cpu->lcd.origin = cpu->cycles;
+        cpu->lcd.drawn = 0;
+        schedule(cpu, cpu->cycles);
+    }
+}
+
+uint8_t lcd_get_stat(cpu_t const *cpu) {
+    if (!lcd_on(cpu)) {
+        return cpu->lcd.stat | (cpu->ram[0xff45] == 0 ? STAT_LYC : 0);
+    }
+
+    uint32_t pos = frame_pos(cpu, cpu->cycles);
+    return cpu->lcd.stat | mode_at(pos) |
+        (pos / LINE_CYCLES == cpu->ram[0xff45] ? STAT_LYC : 0);
+}
+
+void lcd_set_stat(cpu_t *cpu, uint8_t v) {
+    // The mode and LY = LYC bits are read-only.
+    cpu->lcd.stat = v & 0xf8;
+    schedule(cpu, cpu->cycles);
+}
+
+void lcd_set_scy(cpu_t *cpu, uint8_t v) {
+    lcd_catch_up(cpu);
+    cpu->lcd.scy = v;
+}
+
+void lcd_set_scx(cpu_t *cpu, uint8_t v) {
+    lcd_catch_up(cpu);
+    cpu->lcd.scx = v;
+}
+
+uint8_t lcd_get_ly(cpu_t const *cpu) {
+    return lcd_on(cpu) ? frame_pos(cpu, cpu->cycles) / LINE_CYCLES : 0;
+}
+
+void lcd_set_lyc(cpu_t *cpu, uint8_t v) {
+    cpu->ram[0xff45] = v;
+    schedule(cpu, cpu->cycles);
+}
+
+void lcd_set_bgp(cpu_t *cpu, uint8_t v) {
+    lcd_catch_up(cpu);
+    cpu->lcd.bgp = v;
+}
+
+// vim: set sw=4 et:
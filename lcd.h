@@ -0,0 +1,38 @@
+#ifndef LCD_H
+#define LCD_H
+
+#include "cpu.h"
+
+// A frame: 154 lines of 456 cycles.
+#define LCD_FRAME_CYCLES (154 * 456)
+
+// Starts the LCD controller on line 0, as the boot ROM finds it.
+void lcd_init(cpu_t *cpu);
+
+// Draws the lines that have finished since the last call, with the
+// registers and VRAM as they are now.  Anything that's about to change
+// those calls this first.
+void lcd_catch_up(cpu_t *cpu);
+
+// Raises the interrupts EVENT_LCD was scheduled for, at cycle due, and
+// schedules the next; returns whether vblank started, ending the frame.
+int lcd_event(cpu_t *cpu, uint64_t due);
+
+// The cycle after from at which LY or STAT next changes, or SCHED_NEVER
+// with the LCD off.
+uint64_t lcd_next_change(cpu_t const *cpu, uint64_t from);
+
+// I/O handlers for LCDC, STAT, SCY, SCX, LY, LYC and BGP ($FF40-$FF45,
+// $FF47).
+void lcd_set_lcdc(cpu_t *cpu, uint8_t v);
+uint8_t lcd_get_stat(cpu_t const *cpu);
+void lcd_set_stat(cpu_t *cpu, uint8_t v);
+void lcd_set_scy(cpu_t *cpu, uint8_t v);
+void lcd_set_scx(cpu_t *cpu, uint8_t v);
+uint8_t lcd_get_ly(cpu_t const *cpu);
+void lcd_set_lyc(cpu_t *cpu, uint8_t v);
+void lcd_set_bgp(cpu_t *cpu, uint8_t v);
+
+#endif
+
+// vim: set sw=4 et:
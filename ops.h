@@ -0,0 +1,32 @@
+#ifndef OPS_H
+#define OPS_H
+
+#include "cpu.h"
+
+// One entry per opcode: the handler, the register/condition/bit fields
+// decoded out of the opcode, how many immediate bytes follow it, and the
+// base cycle count.
+//
+// Handlers are called with the PC already past the opcode and its
+// immediate operand (if any), which is passed in as n.  They return the
+// cycles spent on top of op->cycles (i.e. for taken branches), or -1.
+struct opcode {
+    int (*fn)(cpu_t *cpu, struct opcode const *op, uint16_t n);
+    uint8_t x, y;
+    uint8_t len;
+    uint8_t cycles;
+    uint8_t flags;
+};
+
+#define OP_JUMP  (1 << 0)  /* may load PC; ends a block */
+#define OP_STORE (1 << 1)  /* may write memory */
+
+// Filled in by ops_init(), which cpu_init() calls.  The 0xCB entry of ops
+// has no cycles of its own; they come from cb_ops.
+extern struct opcode ops[256], cb_ops[256];
+
+void ops_init(void);
+
+#endif
+
+// vim: set sw=4 et:
@@ -0,0 +1,504 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "ops.h"
+#include "cart.h"
+
+// Ahead-of-time recompiler: follows a cart's control flow from its entry
+// points and writes out a C translation of every instruction it reaches,
+// as aot_run() (see ../aot.h).  Build the emulator with AOT=<output> to use
+// it.
+//
+// Code is keyed like the block cache: by bank and PC, with bank 0 for
+// $0000-$3FFF and the selected ROM bank for $4000-$7FFF.  Jumps into the
+// switchable area from bank 0 go to the bank last written to the MBC by a
+// constant (LD A,n / LD HL,nn, then LD (nn),A / LD (HL),A), or to every bank
+// if that isn't known.  Anything not reached this way (RAM, jump tables,
+// code computed at run time) is left to the interpreter by aot_run()'s
+// dispatcher.
+//
+// Loads, stores, register moves, the simple ALU ops and all control flow
+// are written out inline; everything else calls the interpreter's handler
+// through ops[] so the two can't disagree.
+
+#define MAX_BANKS 0x80
+
+static cpu_t cpu;
+static int mbc, banks;
+static uint8_t starts[MAX_BANKS][0x4000];
+static int count;
+
+struct item {
+    int bank, pc, hint;
+};
+
+static struct item *work;
+static int nwork, capwork;
+
+static char const *const r8[8] = {
+    "cpu->b", "cpu->c", "cpu->d", "cpu->e", "cpu->h", "cpu->l", NULL, "cpu->a",
+};
+static char const *const r16[4] = { "cpu->bc", "cpu->de", "cpu->hl", "cpu->sp" };
+static char const *const conds[4] = { "!flag_z(cpu)", "flag_z(cpu)", "!flag_c(cpu)", "flag_c(cpu)" };
+
+#define IS(b, v) (ops[b].fn == ops[v].fn)
+
+int read_file(char const *filename, uint8_t **out, long *len) {
+    FILE *f = fopen(filename, "r");
+    if (!f) {
+        perror(filename);
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    *len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    // Padded by a bank so GET8 never reads off the end.
+    *out = calloc(1, *len + 0x4000);
+    fread(*out, 1, *len, f);
+    fclose(f);
+
+    return 0;
+}
+
+// Reads through GET8 so the bytes are whatever the interpreter would see.
+static uint8_t read8(int bank, int pc) {
+    if (cpu.cart.rom_bank_selected != bank) {
+        cpu.cart.rom_bank_selected = bank;
+        cpu_map(&cpu);
+    }
+    return GET8(&cpu, pc);
+}
+
+static int in_bank(int bank, int pc) {
+    return bank ? pc >= 0x4000 && pc < 0x8000 : pc < 0x4000;
+}
+
+static int compiled(int bank, int pc) {
+    return in_bank(bank, pc) && starts[bank][pc & 0x3fff];
+}
+
+static void add(int bank, int pc, int hint) {
+    if (!in_bank(bank, pc) || starts[bank][pc & 0x3fff]) {
+        return;
+    }
+    if (nwork == capwork) {
+        capwork = capwork ? capwork * 2 : 256;
+        work = realloc(work, capwork * sizeof(*work));
+        if (!work) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    work[nwork++] = (struct item) { bank, pc, hint };
+}
+
+static void add_target(int bank, int to, int hint) {
+    if (to < 0x4000) {
+        add(0, to, hint);
+    } else if (to < 0x8000 && banks > 1) {
+        if (bank) {
+            add(bank, to, -1);
+        } else if (hint > 0) {
+            add(hint, to, -1);
+        } else {
+            for (int b = 1; b < banks; ++b) {
+                add(b, to, -1);
+            }
+        }
+    }
+}
+
+// The bank a write of v to $2000-$3FFF selects.
+static int bank_select(int v) {
+    if (mbc != 3) {
+        return -1;
+    }
+    v &= 0x7f;
+    return v ? v : 1;
+}
+
+static int jr_target(int next, int n) {
+    return (next + (int8_t) n) & 0xffff;
+}
+
+// Marks every instruction reachable from pc in straight-line code, and
+// queues up what it jumps to.  hint is the bank selected for $4000-$7FFF
+// if known, else -1.
+static void scan(int bank, int pc, int hint) {
+    int a = -1, hl = -1;
+
+    while (in_bank(bank, pc) && !starts[bank][pc & 0x3fff]) {
+        int b = read8(bank, pc);
+        int len = 1 + ops[b].len;
+        if (!in_bank(bank, pc + len - 1)) {
+            return;
+        }
+        int n = 0;
+        if (len > 1) {
+            n = read8(bank, pc + 1);
+        }
+        if (len > 2) {
+            n |= read8(bank, pc + 2) << 8;
+        }
+        int next = pc + len, x = ops[b].x;
+
+        starts[bank][pc & 0x3fff] = 1;
+        ++count;
+
+        // Track constants headed for the MBC's bank register.
+        if ((b == 0xea && n >= 0x2000 && n < 0x4000) || (b == 0x77 && hl >= 0x2000 && hl < 0x4000)) {
+            hint = a >= 0 ? bank_select(a) : -1;
+            if (bank && hint > 0) {
+                add(hint, next, -1);
+            }
+        }
+        if (b == 0x3e) {
+            a = n;
+        } else if (b == 0x21) {
+            hl = n;
+        } else if (!(IS(b, 0x00) || IS(b, 0xea) || b == 0x77 || b == 0x01 || b == 0x11 || b == 0x31)) {
+            a = hl = -1;
+        }
+
+        if (IS(b, 0xc3) || IS(b, 0xc2) || IS(b, 0xcd) || IS(b, 0xc4)) {
+            add_target(bank, n, hint);
+        } else if (IS(b, 0x18) || IS(b, 0x20)) {
+            add_target(bank, jr_target(next, n), hint);
+        } else if (IS(b, 0xc7)) {
+            add_target(bank, x * 8, hint);
+        }
+
+        if (IS(b, 0xcd) || IS(b, 0xc7)) {
+            // Returns come back through the dispatcher.
+            add(bank, next, hint);
+            return;
+        } else if (ops[b].flags & OP_JUMP && !IS(b, 0xc2) && !IS(b, 0x20) &&
+                   !IS(b, 0xc4) && !IS(b, 0xc0)) {
+            return;
+        }
+        pc = next;
+    }
+}
+
+static void label(int bank, int pc) {
+    printf("L%02x_%04x", bank, pc);
+}
+
+// Continues at to after pc has been set: straight to its code if it's
+// compiled and can't have changed bank under us, else by the dispatcher.
+static void go(int bank, int to, int writes) {
+    int target = to < 0x4000 ? 0 : bank;
+
+    if (!compiled(target, to)) {
+        printf("goto dispatch;");
+        return;
+    }
+    if (target && writes) {
+        printf("if (cpu->block_exit) goto dispatch; ");
+    }
+    if (to < 0x100) {
+        printf("if (cpu->rom_lock) goto dispatch; ");
+    }
+    printf("goto ");
+    label(target, to);
+    printf(";");
+}
+
+// The usual end of an instruction: count it and carry on with next, by
+// falling into it if fall says it's written out straight after.
+static void end(int bank, int next, int cycles, int writes, int fall) {
+    printf("    AOT_NEXT(0x%04x, %d);\n", next, cycles);
+    if (fall && compiled(bank, next) && !(bank && writes)) {
+        return;
+    }
+    printf("    cpu->pc = 0x%04x; ", next);
+    go(bank, next, writes);
+    printf("\n");
+}
+
+static void operand(char *out, int r) {
+    if (r == 6) {
+        strcpy(out, "GET8(cpu, cpu->hl)");
+    } else {
+        strcpy(out, r8[r]);
+    }
+}
+
+static void emit(int bank, int pc) {
+    int b = read8(bank, pc);
+    struct opcode const *op = &ops[b];
+    int len = 1 + op->len;
+    int n = 0;
+    if (len > 1) {
+        n = read8(bank, pc + 1);
+    }
+    if (len > 2) {
+        n |= read8(bank, pc + 2) << 8;
+    }
+    int next = pc + len, x = op->x, y = op->y, c = op->cycles;
+    int fall = compiled(bank, next);
+    for (int i = pc + 1; i < next; ++i) {
+        fall = fall && !compiled(bank, i);
+    }
+    char src[32];
+
+    label(bank, pc);
+    printf(":  //");
+    for (int i = 0; i < len; ++i) {
+        printf(" %02x", read8(bank, pc + i));
+    }
+    printf("\n");
+
+    if (IS(b, 0x00)) {
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0x40) || IS(b, 0x46) || IS(b, 0x70)) {
+        operand(src, y);
+        if (x == 6) {
+            printf("    SET8(cpu, cpu->hl, %s);\n", src);
+        } else {
+            printf("    %s = %s;\n", r8[x], src);
+        }
+        end(bank, next, c, x == 6, fall);
+    } else if (IS(b, 0x06) || IS(b, 0x36)) {
+        if (x == 6) {
+            printf("    SET8(cpu, cpu->hl, 0x%02x);\n", n);
+        } else {
+            printf("    %s = 0x%02x;\n", r8[x], n);
+        }
+        end(bank, next, c, x == 6, fall);
+    } else if (IS(b, 0x0a) || IS(b, 0x1a) || IS(b, 0x2a) || IS(b, 0x3a) || IS(b, 0xfa) || IS(b, 0xf0)) {
+        if (IS(b, 0xfa) || IS(b, 0xf0)) {
+            sprintf(src, "0x%04x", IS(b, 0xf0) ? 0xff00 + n : n);
+        } else {
+            strcpy(src, IS(b, 0x0a) ? "cpu->bc" : IS(b, 0x1a) ? "cpu->de" :
+                        IS(b, 0x2a) ? "cpu->hl++" : "cpu->hl--");
+        }
+        printf("    cpu->a = GET8(cpu, %s);\n", src);
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0x02) || IS(b, 0x12) || IS(b, 0x22) || IS(b, 0x32) || IS(b, 0xea) || IS(b, 0xe0) || IS(b, 0xe2)) {
+        if (IS(b, 0xea) || IS(b, 0xe0)) {
+            sprintf(src, "0x%04x", IS(b, 0xe0) ? 0xff00 + n : n);
+        } else {
+            strcpy(src, IS(b, 0x02) ? "cpu->bc" : IS(b, 0x12) ? "cpu->de" :
+                        IS(b, 0x22) ? "cpu->hl++" : IS(b, 0x32) ? "cpu->hl--" :
+                        "0xff00 + cpu->c");
+        }
+        printf("    SET8(cpu, %s, cpu->a);\n", src);
+        end(bank, next, c, 1, fall);
+    } else if (IS(b, 0x01)) {
+        printf("    %s = 0x%04x;\n", r16[x], n);
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0x03) || IS(b, 0x0b)) {
+        printf("    %s %s= 1;\n", r16[x], IS(b, 0x03) ? "+" : "-");
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0xa0) || IS(b, 0xa6) || IS(b, 0xe6)) {
+        if (IS(b, 0xe6)) {
+            sprintf(src, "0x%02x", n);
+        } else {
+            operand(src, x);
+        }
+        printf("    cpu->a &= %s;\n", src);
+        printf("    cpu->flags_op = FLAGS_AND;\n");
+        printf("    cpu->flags_r = cpu->a;\n");
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0xb0) || IS(b, 0xb6) || IS(b, 0xa8) || IS(b, 0xae)) {
+        operand(src, x);
+        printf("    cpu->a %s= %s;\n", IS(b, 0xb0) || IS(b, 0xb6) ? "|" : "^", src);
+        printf("    cpu->flags_op = FLAGS_OR;\n");
+        printf("    cpu->flags_r = cpu->a;\n");
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0x80) || IS(b, 0x86) || IS(b, 0xc6) || IS(b, 0x90) || IS(b, 0x96) || IS(b, 0xd6) ||
+               IS(b, 0xb8) || IS(b, 0xbe) || IS(b, 0xfe)) {
+        int add = IS(b, 0x80) || IS(b, 0x86) || IS(b, 0xc6),
+            sub = IS(b, 0x90) || IS(b, 0x96) || IS(b, 0xd6);
+        if (IS(b, 0xc6) || IS(b, 0xd6) || IS(b, 0xfe)) {
+            sprintf(src, "0x%02x", n);
+        } else {
+            operand(src, x);
+        }
+        printf("    cpu->flags_op = %s;\n", add ? "FLAGS_ADD" : "FLAGS_SUB");
+        printf("    cpu->flags_a = cpu->a;\n");
+        printf("    cpu->flags_b = %s;\n", src);
+        if (add) {
+            printf("    cpu->a += cpu->flags_b;\n");
+        } else if (sub) {
+            printf("    cpu->a -= cpu->flags_b;\n");
+        }
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0x04) || IS(b, 0x05)) {
+        printf("    {\n");
+        printf("        uint8_t v = %s%s;\n", IS(b, 0x04) ? "++" : "--", r8[x]);
+        printf("        cpu->flags_c = flag_c(cpu);\n");
+        printf("        cpu->flags_op = %s;\n", IS(b, 0x04) ? "FLAGS_INC" : "FLAGS_DEC");
+        printf("        cpu->flags_r = v;\n");
+        printf("    }\n");
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0xc3) || IS(b, 0x18)) {
+        int to = IS(b, 0x18) ? jr_target(next, n) : n;
+        printf("    AOT_JUMP(0x%04x, %d);\n    ", to, c);
+        go(bank, to, 0);
+        printf("\n");
+    } else if (IS(b, 0xc2) || IS(b, 0x20)) {
+        int to = IS(b, 0x20) ? jr_target(next, n) : n;
+        printf("    if (%s) {\n", conds[x]);
+        printf("        AOT_JUMP(0x%04x, %d);\n        ", to, c + 4);
+        go(bank, to, 0);
+        printf("\n    }\n");
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0xcd) || IS(b, 0xc7)) {
+        int to = IS(b, 0xc7) ? x * 8 : n;
+        printf("    PUSH16(cpu, 0x%04x);\n", next);
+        printf("    AOT_JUMP(0x%04x, %d);\n    ", to, c);
+        go(bank, to, 1);
+        printf("\n");
+    } else if (IS(b, 0xc4)) {
+        printf("    if (%s) {\n", conds[x]);
+        printf("        PUSH16(cpu, 0x%04x);\n", next);
+        printf("        AOT_JUMP(0x%04x, %d);\n        ", n, c + 12);
+        go(bank, n, 1);
+        printf("\n    }\n");
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0xc9) || IS(b, 0xe9)) {
+        printf("    AOT_JUMP(%s, %d);\n", IS(b, 0xc9) ? "POP16(cpu)" : "cpu->hl", c);
+        printf("    goto dispatch;\n");
+    } else if (IS(b, 0xc0)) {
+        printf("    if (%s) {\n", conds[x]);
+        printf("        AOT_JUMP(POP16(cpu), %d);\n", c + 12);
+        printf("        goto dispatch;\n");
+        printf("    }\n");
+        end(bank, next, c, 0, fall);
+    } else if (IS(b, 0xcb)) {
+        printf("    cpu->pc = 0x%04x;\n", next);
+        printf("    if (cb_ops[0x%02x].fn(cpu, &cb_ops[0x%02x], 0) < 0) {\n", n, n);
+        printf("        return -1;\n");
+        printf("    }\n");
+        end(bank, next, cb_ops[n].cycles, 1, fall);
+    } else {
+        printf("    cpu->pc = 0x%04x;\n", next);
+        printf("    if (ops[0x%02x].fn(cpu, &ops[0x%02x], 0x%04x) < 0) {\n", b, b, n);
+        printf("        return -1;\n");
+        printf("    }\n");
+        if (op->flags & OP_JUMP) {
+            // RETI, which has set cpu->pc, or op_unknown, which has failed.
+            printf("    AOT_JUMP(cpu->pc, %d);\n", c);
+            printf("    goto dispatch;\n");
+        } else {
+            end(bank, next, c, 1, fall);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    uint8_t *cart;
+    long cartlen;
+
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s cart.gb out.c\n", argv[0]);
+        return 1;
+    }
+
+    read_file(argv[1], &cart, &cartlen);
+    if (cartlen < 0x8000) {
+        fprintf(stderr, "%s: too short for a cart\n", argv[1]);
+        return 1;
+    }
+
+    ops_init();
+    cart_init(&cpu, cart, cartlen);
+
+    // Only carts without an MBC or with MBC3, whose bank writes scan()
+    // follows, get their switchable area compiled.
+    switch (cart[0x147]) {
+    case 0x00:
+        mbc = 0;
+        banks = 2;
+        break;
+    case 0x0f:
+    case 0x10:
+    case 0x11:
+    case 0x12:
+    case 0x13:
+        mbc = 3;
+        banks = cartlen / 0x4000;
+        if (banks > MAX_BANKS) {
+            banks = MAX_BANKS;
+        }
+        break;
+    default:
+        mbc = -1;
+        banks = 1;
+        break;
+    }
+    cpu_map(&cpu);
+
+    add(0, 0x100, -1);
+    for (int v = 0; v < 0x68; v += 8) {
+        add(0, v, -1);
+    }
+    while (nwork) {
+        struct item it = work[--nwork];
+        scan(it.bank, it.pc, it.hint);
+    }
+
+    if (!freopen(argv[2], "w", stdout)) {
+        perror(argv[2]);
+        return 1;
+    }
+
+    printf("// Generated by recomp from %s; do not edit.\n\n", argv[1]);
+    printf("#include \"cpu.h\"\n");
+    printf("#include \"ops.h\"\n");
+    printf("#include \"aot.h\"\n");
+    printf("#include \"flags.h\"\n\n");
+    printf("#define NONE 0xffffffff\n\n");
+    printf("static uint32_t key(cpu_t const *cpu) {\n");
+    printf("    uint16_t pc = cpu->pc;\n");
+    printf("    if (pc < 0x100 && cpu->rom_lock) {\n");
+    printf("        return NONE;\n");
+    printf("    } else if (pc < 0x4000 && !cpu->cart.rom_bank0) {\n");
+    printf("        return pc;\n");
+    if (banks > 1) {
+        printf("    } else if (pc < 0x8000 && cpu->cart.mbc == %d) {\n", mbc);
+        printf("        return (uint32_t) %s << 16 | pc;\n", mbc == 3 ? "cpu->cart.rom_bank_selected" : "1");
+    }
+    printf("    }\n");
+    printf("    return NONE;\n");
+    printf("}\n\n");
+
+    printf("int aot_run(cpu_t *cpu, int budget) {\n");
+    printf("    int elapsed = 0;\n\n");
+    printf("dispatch:\n");
+    printf("    cpu->block_exit = 0;\n");
+    printf("    switch (key(cpu)) {\n");
+    for (int bank = 0; bank < banks; ++bank) {
+        for (int i = 0; i < 0x4000; ++i) {
+            if (starts[bank][i]) {
+                int pc = bank ? 0x4000 + i : i;
+                printf("    case 0x%x: goto ", bank << 16 | pc);
+                label(bank, pc);
+                printf(";\n");
+            }
+        }
+    }
+    printf("    default:\n");
+    printf("        AOT_INTERPRET();\n");
+    printf("        goto dispatch;\n");
+    printf("    }\n\n");
+
+    for (int bank = 0; bank < banks; ++bank) {
+        for (int i = 0; i < 0x4000; ++i) {
+            if (starts[bank][i]) {
+                emit(bank, bank ? 0x4000 + i : i);
+            }
+        }
+    }
+    printf("}\n");
+
+    fprintf(stderr, "recomp: %d instructions in %d banks\n", count, banks);
+    return 0;
+}
+
+// vim: set sw=4 et:
@@ -0,0 +1,201 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+#include "save.h"
+
+// Battery-backed cart RAM.  The .sav file is mapped shared in place of
+// the cart RAM cart_init() allocated, so the game's writes to it are
+// writes to the file's pages, and nothing on the emulation thread ever
+// waits for the disk: a flusher thread msyncs the file every
+// SAVE_FLUSH_MS milliseconds (1000 if that isn't set), and save_close()
+// does once more on the way out.  The file's pages are faulted in when
+// it's mapped so the first write to each doesn't have to read it.
+//
+// MBC3's clock follows the RAM image, in the 48-byte footer other
+// emulators use too: the clock registers and then the latched copy, each
+// widened to 32 bits, and the host time they're as of in 64; all little
+// endian.  Unlike the RAM it's only written by save_close(), as the
+// emulation thread keeps it; a clock saved earlier still reads right,
+// bar what the game has set it to since, as it runs on from the time
+// saved with it.
+
+#define FLUSH_MS_DEFAULT 1000
+#define CLOCK_SIZE 48
+
+static struct {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int running, stop;
+    uint8_t *ram;
+    long size;
+    long interval_ms;
+} flusher = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+static void *flush_loop(void *arg) {
+    pthread_mutex_lock(&flusher.lock);
+    while (!flusher.stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += flusher.interval_ms / 1000;
+        until.tv_nsec += (flusher.interval_ms % 1000) * 1000000;
+        if (until.tv_nsec >= 1000000000) {
+            until.tv_sec += 1;
+            until.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&flusher.wake, &flusher.lock, &until);
+        if (!flusher.stop && msync(flusher.ram, flusher.size, MS_SYNC) < 0) {
+            perror("msync");
+        }
+    }
+    pthread_mutex_unlock(&flusher.lock);
+    return NULL;
+}
+
+static void put_le(uint8_t *p, uint64_t v, int n) {
+    for (int i = 0; i < n; ++i) {
+        p[i] = v >> i * 8;
+    }
+}
+
+static uint64_t get_le(uint8_t const *p, int n) {
+    uint64_t v = 0;
+    for (int i = 0; i < n; ++i) {
+        v |= (uint64_t) p[i] << i * 8;
+    }
+    return v;
+}
+
+static void clock_save(cpu_t const *cpu, uint8_t *p) {
+    for (int i = 0; i < 5; ++i) {
+        put_le(p + i * 4, cpu->cart.rtc[i], 4);
+        put_le(p + 20 + i * 4, cpu->cart.rtc_latched[i], 4);
+    }
+    put_le(p + 40, cpu->cart.rtc_time, 8);
+}
+
+static void clock_load(cpu_t *cpu, uint8_t const *p) {
+    for (int i = 0; i < 5; ++i) {
+        cpu->cart.rtc[i] = get_le(p + i * 4, 4);
+        cpu->cart.rtc_latched[i] = get_le(p + 20 + i * 4, 4);
+    }
+    cpu->cart.rtc_time = get_le(p + 40, 8);
+}
+
+// cart_path with its extension, if any, replaced by .sav.
+static char *sav_path(char const *cart_path) {
+    char const *slash = strrchr(cart_path, '/'), *dot = strrchr(cart_path, '.');
+    size_t len = dot && (!slash || dot > slash) ? (size_t) (dot - cart_path) : strlen(cart_path);
+
+    char *path = malloc(len + sizeof(".sav"));
+    if (!path) {
+        fprintf(stderr, "couldn't allocate save path\n");
+        exit(1);
+    }
+    memcpy(path, cart_path, len);
+    strcpy(path + len, ".sav");
+    return path;
+}
+
+int save_open(cpu_t *cpu, char const *cart_path) {
+    if (!cpu->cart.battery || (!cpu->cart.ram_size && !cpu->cart.clock)) {
+        return 0;
+    }
+    long size = cpu->cart.ram_size + (cpu->cart.clock ? CLOCK_SIZE : 0);
+
+    char *path = sav_path(cart_path);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        perror(path);
+        free(path);
+        return -1;
+    }
+
+    // A new file starts out zeroed, like the RAM it replaces, and keeps
+    // the clock cart_init() started.  One that's longer than what's kept
+    // here is left so.
+    if (st.st_size < size && ftruncate(fd, size) < 0) {
+        perror(path);
+        close(fd);
+        free(path);
+        return -1;
+    }
+
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    flags |= MAP_POPULATE;
+#endif
+    uint8_t *ram = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, fd, 0);
+    close(fd);
+    if (ram == MAP_FAILED) {
+        perror(path);
+        free(path);
+        return -1;
+    }
+#ifndef MAP_POPULATE
+    madvise(ram, size, MADV_WILLNEED);
+#endif
+
+    if (cpu->cart.clock && st.st_size >= size) {
+        clock_load(cpu, ram + cpu->cart.ram_size);
+    }
+    free(cpu->cart.ram);
+    cpu->cart.ram = ram;
+    cpu_map(cpu);
+
+    char const *interval = getenv("SAVE_FLUSH_MS");
+    flusher.ram = ram;
+    flusher.size = size;
+    flusher.interval_ms = interval && atol(interval) > 0 ? atol(interval) : FLUSH_MS_DEFAULT;
+    flusher.stop = 0;
+    if (pthread_create(&flusher.thread, NULL, flush_loop, NULL)) {
+        fprintf(stderr, "couldn't start the save flusher; saving on exit only\n");
+    } else {
+        flusher.running = 1;
+    }
+
+    printf("cart RAM saved to %s\n", path);
+    free(path);
+    return 0;
+}
+
+void save_close(cpu_t *cpu) {
+    if (!flusher.ram) {
+        return;
+    }
+
+    if (flusher.running) {
+        pthread_mutex_lock(&flusher.lock);
+        flusher.stop = 1;
+        pthread_cond_signal(&flusher.wake);
+        pthread_mutex_unlock(&flusher.lock);
+        pthread_join(flusher.thread, NULL);
+        flusher.running = 0;
+    }
+
+    if (cpu->cart.clock) {
+        clock_save(cpu, flusher.ram + cpu->cart.ram_size);
+    }
+    if (msync(flusher.ram, flusher.size, MS_SYNC) < 0) {
+        perror("msync");
+    }
+    munmap(flusher.ram, flusher.size);
+    flusher.ram = NULL;
+
+    cpu->cart.ram = NULL;
+    cpu->cart.ram_size = 0;
+    cpu_map(cpu);
+}
+
+// vim: set sw=4 et:
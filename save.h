@@ -0,0 +1,17 @@
+#ifndef SAVE_H
+#define SAVE_H
+
+#include "cpu.h"
+
+// Moves the RAM of a cart with a battery into the .sav file next to
+// cart_path, creating it if need be, and starts writing it back in the
+// background; and restores MBC3's clock from it.  Does nothing for other
+// carts; returns -1 on failure.
+int save_open(cpu_t *cpu, char const *cart_path);
+
+// Writes the cart RAM, and the clock, back one last time and unmaps it.
+void save_close(cpu_t *cpu);
+
+#endif
+
+// vim: set sw=4 et:
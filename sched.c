@@ -0,0 +1,57 @@
+#include "cpu.h"
+#include "sched.h"
+
+// The event schedule.  Each kind of event is pending at most once, so the
+// schedule is just the cycle each is next due at, plus the earliest of
+// those for run() to run the CPU up to.  With this few kinds, finding that
+// is a scan rather than a heap.
+
+static void find_next(cpu_t *cpu) {
+    cpu->sched.next = SCHED_NEVER;
+    for (int ev = 0; ev < EVENT_COUNT; ++ev) {
+        if (cpu->sched.at[ev] < cpu->sched.next) {
+            cpu->sched.next = cpu->sched.at[ev];
+        }
+    }
+}
+
+void sched_init(cpu_t *cpu) {
+    for (int ev = 0; ev < EVENT_COUNT; ++ev) {
+        cpu->sched.at[ev] = SCHED_NEVER;
+    }
+    cpu->sched.next = SCHED_NEVER;
+}
+
+void sched_at(cpu_t *cpu, enum event ev, uint64_t when) {
+    // The CPU may be running up to the old next event, in which case it
+    // has to stop after this instruction for run_cycles() to see the new
+    // one.
+    if (when < cpu->sched.next) {
+        cpu->stop = 1;
+        cpu->block_exit = 1;
+    }
+    cpu->sched.at[ev] = when;
+    find_next(cpu);
+}
+
+void sched_cancel(cpu_t *cpu, enum event ev) {
+    sched_at(cpu, ev, SCHED_NEVER);
+}
+
+int sched_pop(cpu_t *cpu, uint64_t *when) {
+    if (cpu->sched.next > cpu->cycles) {
+        return -1;
+    }
+
+    // Ties go to the event listed first in enum event.
+    for (int ev = 0; ev < EVENT_COUNT; ++ev) {
+        if (cpu->sched.at[ev] == cpu->sched.next) {
+            *when = cpu->sched.at[ev];
+            sched_cancel(cpu, ev);
+            return ev;
+        }
+    }
+    return -1;
+}
+
+// vim: set sw=4 et:
@@ -0,0 +1,24 @@
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "cpu.h"
+
+#define SCHED_NEVER UINT64_MAX
+
+// Clears the schedule.
+void sched_init(cpu_t *cpu);
+
+// Schedules ev for cycle when, in place of any pending one.  If that's
+// sooner than the next event was, sets cpu->stop for run_cycles().
+void sched_at(cpu_t *cpu, enum event ev, uint64_t when);
+
+void sched_cancel(cpu_t *cpu, enum event ev);
+
+// Takes the earliest event that's due by cpu->cycles off the schedule and
+// returns it, with the cycle it was due at in *when for rescheduling from;
+// -1 if none is.
+int sched_pop(cpu_t *cpu, uint64_t *when);
+
+#endif
+
+// vim: set sw=4 et:
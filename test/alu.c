@@ -0,0 +1,272 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "cpu.h"
+#include "ops.h"
+#include "flags.h"
+#include "block.h"
+
+// Runs every opcode and CB opcode from random registers, flags and memory,
+// on whichever core this is built for (Makefile), and checks F against a
+// reference that works each flag out directly, as the core did before the
+// flags went lazy (flags.h).  The flags going in are left lazy half the
+// time, as an earlier ALU op would have left them.
+
+#define CASES 1000
+
+// The instruction runs from CODE, followed by a JR to itself; everything
+// it reads or writes through a register or an address operand is in the
+// 4 KB from DATA, or in HRAM for LDH.
+#define CODE 0xc100
+#define DATA 0xd000
+
+// What the reference needs to know of the state going in: the registers,
+// F as the guest sees it, the immediate operand and the bytes at (HL) and
+// (SP).
+struct regs {
+    uint8_t a, f, b, c, d, e, h, l;
+    uint16_t sp;
+    uint8_t n, mhl, msp;
+};
+
+static uint32_t seed = 1;
+
+static uint32_t rnd(void) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return seed;
+}
+
+static uint8_t F(int z, int n, int h, int c) {
+    return z << 7 | n << 6 | h << 5 | c << 4;
+}
+
+static uint8_t reg8(struct regs const *s, int r) {
+    switch (r) {
+        case 0: return s->b;
+        case 1: return s->c;
+        case 2: return s->d;
+        case 3: return s->e;
+        case 4: return s->h;
+        case 5: return s->l;
+        case 6: return s->mhl;
+        default: return s->a;
+    }
+}
+
+static uint8_t reference_cb(struct regs const *s, uint8_t cb) {
+    int c = s->f >> 4 & 1;
+    uint8_t v = reg8(s, cb & 0x7);
+    uint8_t r;
+
+    switch (cb & 0xf8) {
+        case 0x00: r = v << 1 | v >> 7; c = v >> 7; break;      // RLC
+        case 0x08: r = v >> 1 | v << 7; c = v & 1; break;       // RRC
+        case 0x10: r = v << 1 | c; c = v >> 7; break;           // RL
+        case 0x18: r = v >> 1 | c << 7; c = v & 1; break;       // RR
+        case 0x20: r = v << 1; c = v >> 7; break;               // SLA
+        case 0x28: r = v >> 1 | (v & 0x80); c = v & 1; break;   // SRA
+        case 0x30: return s->f;                                 // SWAP (!)
+        case 0x38: r = v >> 1; c = v & 1; break;                // SRL
+        default:
+            if ((cb & 0xc0) == 0x40) {                          // BIT
+                return F(!(v >> (cb >> 3 & 0x7) & 1), 0, 1, c);
+            }
+            return s->f;                                        // SET, RES
+    }
+    return F(r == 0, 0, 0, c);
+}
+
+static uint8_t reference_daa(struct regs const *s) {
+    int n = s->f >> 6 & 1, h = s->f >> 5 & 1, c = s->f >> 4 & 1;
+    int fix = 0;
+
+    if (h || (!n && (s->a & 0xf) > 0x9)) {
+        fix |= 0x06;
+    }
+    if (c || (!n && s->a > 0x99)) {
+        fix |= 0x60;
+        c = 1;
+    }
+    return F((uint8_t) (n ? s->a - fix : s->a + fix) == 0, n, 0, c);
+}
+
+// F after op (and cb, after $CB) runs from s.
+static uint8_t reference(struct regs const *s, uint8_t op, uint8_t cb) {
+    int z = s->f >> 7 & 1, c = s->f >> 4 & 1;
+    uint16_t hl = s->h << 8 | s->l;
+    uint8_t v;
+    int r;
+
+    if ((op & 0xc0) == 0x80 || (op & 0xc7) == 0xc6) {
+        v = (op & 0xc0) == 0x80 ? reg8(s, op & 0x7) : s->n;
+        switch (op >> 3 & 0x7) {
+            case 0:  // ADD
+                r = s->a + v;
+                return F((r & 0xff) == 0, 0, ((s->a ^ v ^ r) & 0x10) != 0, r > 0xff);
+            case 2:  // SUB
+            case 7:  // CP
+                r = s->a - v;
+                return F(r == 0, 1, ((s->a ^ v ^ r) & 0x10) != 0, r < 0);
+            case 4:  // AND
+                return F((s->a & v) == 0, 0, 1, 0);
+            case 5:  // XOR
+                return F((s->a ^ v) == 0, 0, 0, 0);
+            case 6:  // OR
+                return F((s->a | v) == 0, 0, 0, 0);
+        }
+    } else if ((op & 0xc7) == 0x04) {  // INC r
+        r = (uint8_t) (reg8(s, op >> 3 & 0x7) + 1);
+        return F(r == 0, 0, (r & 0xf) == 0x0, c);
+    } else if ((op & 0xc7) == 0x05) {  // DEC r
+        r = (uint8_t) (reg8(s, op >> 3 & 0x7) - 1);
+        return F(r == 0, 1, (r & 0xf) == 0xf, c);
+    } else if ((op & 0xcf) == 0x09) {  // ADD HL,ss
+        uint16_t ss[4] = { s->b << 8 | s->c, s->d << 8 | s->e, hl, s->sp };
+        v = op >> 4;
+        return F(z, 0, (hl & 0xfff) + (ss[v] & 0xfff) > 0xfff, hl + ss[v] > 0xffff);
+    }
+
+    switch (op) {
+        // The A rotates set Z like the CB ones do (!)
+        case 0x07: return reference_cb(s, 0x07);
+        case 0x0f: return reference_cb(s, 0x0f);
+        case 0x17: return reference_cb(s, 0x17);
+        case 0x1f: return reference_cb(s, 0x1f);
+        case 0x27: return reference_daa(s);
+        case 0x2f: return F(z, 0, 0, c);  // CPL (!)
+        case 0x37: return F(z, 0, 0, 1);
+        case 0x3f: return F(z, 0, 0, !c);
+        case 0xcb: return reference_cb(s, cb);
+        case 0xf1: return s->msp & 0xf0;
+        default:   return s->f;
+    }
+}
+
+static uint16_t data_addr(void) {
+    return DATA + 2 + rnd() % 0xffc;
+}
+
+// Sets up a random state to run op (and cb) from, and returns what the
+// reference needs of it.
+static struct regs setup(cpu_t *cpu, uint8_t op, uint8_t cb) {
+    cpu->a = rnd();
+    cpu->bc = data_addr();
+    cpu->de = data_addr();
+    cpu->hl = data_addr();
+    cpu->sp = data_addr();
+    cpu->pc = CODE;
+
+    cpu->ram[cpu->bc] = rnd();
+    cpu->ram[cpu->de] = rnd();
+    cpu->ram[cpu->hl] = rnd();
+    cpu->ram[cpu->sp] = rnd();
+    cpu->ram[cpu->sp + 1] = rnd();
+
+    if (rnd() & 1) {
+        cpu->flags_op = FLAGS_NONE;
+        cpu->f = rnd() & 0xf0;
+    } else {
+        cpu->flags_op = FLAGS_ADD + rnd() % FLAGS_DEC;
+        cpu->flags_a = rnd();
+        cpu->flags_b = rnd();
+        cpu->flags_r = rnd();
+        cpu->flags_c = rnd() & 1;
+    }
+
+    // Addresses that aren't in a register are kept in DATA or HRAM too.
+    uint16_t n = rnd();
+    if (op == 0xe2) {
+        cpu->c = 0x80 | rnd() % 0x7f;
+    } else if (op == 0xe0 || op == 0xf0) {
+        n = 0x80 | rnd() % 0x7f;
+    } else if (op == 0x08 || op == 0xea || op == 0xfa) {
+        n = data_addr();
+    } else if (op == 0xcb) {
+        n = cb;
+    }
+
+    uint16_t pc = CODE;
+    cpu->ram[pc++] = op;
+    if (ops[op].len > 0) {
+        cpu->ram[pc++] = n;
+    }
+    if (ops[op].len > 1) {
+        cpu->ram[pc++] = n >> 8;
+    }
+    cpu->ram[pc++] = 0x18;
+    cpu->ram[pc++] = 0xfe;
+
+    cpu->ime = cpu->ei = 0;
+    cpu->halted = cpu->halt_bug = 0;
+    cpu->stop = 0;
+    cpu->ram[0xff0f] = 0;
+    cpu->ram[0xffff] = 0;
+    block_flush(cpu);
+
+    return (struct regs) {
+        .a = cpu->a, .f = flags_get(cpu),
+        .b = cpu->b, .c = cpu->c, .d = cpu->d, .e = cpu->e, .h = cpu->h, .l = cpu->l,
+        .sp = cpu->sp, .n = n, .mhl = cpu->ram[cpu->hl], .msp = cpu->ram[cpu->sp],
+    };
+}
+
+// Runs the instruction at CODE from each of CASES states; returns the
+// number of mismatches.
+static int check(cpu_t *cpu, uint8_t op, uint8_t cb) {
+    int bad = 0;
+
+    for (int i = 0; i < CASES; ++i) {
+        struct regs s = setup(cpu, op, cb);
+        uint8_t want = reference(&s, op, cb);
+
+        // Jumps go anywhere, so they're run on their own; anything else
+        // is followed by the JR, which doesn't touch the flags, and the
+        // budget lets a block core run both in one go.
+        int jump = op == 0xcb ? 0 : ops[op].flags & OP_JUMP;
+        if (cpu_run(cpu, jump ? 1 : 64) < 0) {
+            fprintf(stderr, "%02x %02x: failed\n", op, cb);
+            return CASES;
+        }
+
+        uint8_t got = flags_get(cpu);
+        if (op == 0xf5) {
+            // PUSH AF leaves F where the guest can see it.
+            got = cpu->ram[cpu->sp];
+        }
+        if (got != want && ++bad <= 3) {
+            fprintf(stderr, "%02x %02x: A=%02x F=%02x BC=%02x%02x DE=%02x%02x HL=%02x%02x "
+                    "SP=%04x n=%02x (HL)=%02x: F=%02x, want %02x\n",
+                    op, cb, s.a, s.f, s.b, s.c, s.d, s.e, s.h, s.l,
+                    s.sp, s.n, s.mhl, got, want);
+        }
+    }
+    return bad;
+}
+
+int main(int argc, char **argv) {
+    static uint8_t rom[0x100], cart[0x8000];
+    static cpu_t cpu;
+    int ran = 0, bad = 0;
+
+    cpu_init(&cpu, rom, cart, sizeof(cart));
+
+    for (int op = 0; op < 0x100; ++op) {
+        // $D3 isn't an opcode.
+        if (op == 0xcb || ops[op].fn == ops[0xd3].fn) {
+            continue;
+        }
+        bad += check(&cpu, op, 0);
+        ++ran;
+    }
+    for (int cb = 0; cb < 0x100; ++cb) {
+        bad += check(&cpu, 0xcb, cb);
+        ++ran;
+    }
+
+    printf("%s: %d opcodes, %d cases, %d mismatches\n", argv[0], ran, ran * CASES, bad);
+    return bad != 0;
+}
+
+// vim: set sw=4 et:
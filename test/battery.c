@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "cpu.h"
+#include "save.h"
+
+// Round trips battery-backed carts through save.c: opens a new .sav file,
+// writes the cart RAM and sets the clock, closes it, and checks that the
+// file holds them and that opening it again brings them back.  Once for
+// an MBC3 cart with RAM and the clock, once for one with the clock alone.
+
+#define CLOCK_SIZE 48
+
+static int bad;
+
+static void expect(char const *what, long got, long want) {
+    if (got != want && ++bad <= 10) {
+        fprintf(stderr, "%s: %lx, want %lx\n", what, got, want);
+    }
+}
+
+// The n-byte little-endian number at p.
+static long le(uint8_t const *p, int n) {
+    long v = 0;
+    for (int i = n - 1; i >= 0; --i) {
+        v = v << 8 | p[i];
+    }
+    return v;
+}
+
+static void open_cart(cpu_t *cpu, uint8_t const *cart, char const *path) {
+    static uint8_t const rom[0x100];
+
+    cpu_init(cpu, rom, cart, 0x8000);
+    if (save_open(cpu, path) < 0) {
+        fprintf(stderr, "%s: couldn't open the save\n", path);
+        exit(1);
+    }
+}
+
+static void check(char const *dir, uint8_t type, uint8_t ram_size) {
+    static uint8_t cart[0x8000];
+    static cpu_t cpu;
+    static uint8_t const rtc[5] = { 59, 58, 23, 0xff, 0x01 }, latched[5] = { 1, 2, 3, 4, 0x40 };
+    time_t when = 0x123456789;
+
+    cart[0x0147] = type;
+    cart[0x0149] = ram_size;
+    char cart_path[256], sav_path[256];
+    snprintf(cart_path, sizeof(cart_path), "%s/%02x.gb", dir, type);
+    snprintf(sav_path, sizeof(sav_path), "%s/%02x.sav", dir, type);
+
+    open_cart(&cpu, cart, cart_path);
+    long size = cpu.cart.ram_size;
+    for (long i = 0; i < size; ++i) {
+        expect("new RAM", cpu.cart.ram[i], 0);
+        cpu.cart.ram[i] = i * 7 + (i >> 8);
+    }
+    memcpy(cpu.cart.rtc, rtc, sizeof(rtc));
+    memcpy(cpu.cart.rtc_latched, latched, sizeof(latched));
+    cpu.cart.rtc_time = when;
+    save_close(&cpu);
+
+    FILE *f = fopen(sav_path, "rb");
+    uint8_t file[0x2000 + CLOCK_SIZE];
+    long got = f ? fread(file, 1, sizeof(file), f) : -1;
+    if (f) {
+        fclose(f);
+    }
+    expect("file size", got, size + CLOCK_SIZE);
+    if (got == size + CLOCK_SIZE) {
+        for (long i = 0; i < size; ++i) {
+            expect("saved RAM", file[i], (uint8_t) (i * 7 + (i >> 8)));
+        }
+        uint8_t const *footer = file + size;
+        for (int i = 0; i < 5; ++i) {
+            expect("saved clock", le(footer + i * 4, 4), rtc[i]);
+            expect("saved latched clock", le(footer + 20 + i * 4, 4), latched[i]);
+        }
+        expect("saved time", le(footer + 40, 8), when);
+    }
+
+    open_cart(&cpu, cart, cart_path);
+    expect("RAM size", cpu.cart.ram_size, size);
+    for (long i = 0; i < size; ++i) {
+        expect("RAM", cpu.cart.ram[i], (uint8_t) (i * 7 + (i >> 8)));
+    }
+    for (int i = 0; i < 5; ++i) {
+        expect("clock", cpu.cart.rtc[i], rtc[i]);
+        expect("latched clock", cpu.cart.rtc_latched[i], latched[i]);
+    }
+    expect("time", cpu.cart.rtc_time, when);
+    save_close(&cpu);
+
+    unlink(sav_path);
+}
+
+int main(int argc, char **argv) {
+    char dir[] = "/tmp/battery.XXXXXX";
+    if (!mkdtemp(dir)) {
+        perror(dir);
+        return 1;
+    }
+
+    // MBC3+TIMER+RAM+BATTERY with 8 KB, and MBC3+TIMER+BATTERY.
+    check(dir, 0x10, 0x02);
+    check(dir, 0x0f, 0x00);
+    rmdir(dir);
+
+    printf("%s: %d mismatches\n", argv[0], bad);
+    return bad != 0;
+}
+
+// vim: set sw=4 et:
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "cpu.h"
+
+// A microbenchmark of the fetch/execute path: a loop that loads through
+// HL, adds and counts down, run from WRAM on whichever core this is built
+// for (Makefile), a frame's worth of cycles at a time as run() would.  It
+// prints the time per guest instruction; for cache behaviour, run it
+// under perf, e.g.
+//
+//     perf stat -e instructions,L1-dcache-loads,L1-dcache-load-misses ./bench_blocks
+//
+// and divide the misses by the guest instructions it reports.
+
+#define FRAME_CYCLES 70224
+
+// LD HL,$D000; LD C,0; loop: LD A,(HL+); ADD A,B; LD B,A; DEC C;
+// JR NZ,loop; JR back to the start.
+static uint8_t const code[] = {
+    0x21, 0x00, 0xd0, 0x0e, 0x00,
+    0x2a, 0x80, 0x47, 0x0d, 0x20, 0xfa,
+    0x18, 0xf3,
+};
+
+// Cycles and instructions once round the outer loop: 256 times round the
+// inner one, the last without the JR NZ taken.
+#define LOOP_CYCLES (12 + 8 + 256 * 32 - 4 + 12)
+#define LOOP_INSTRUCTIONS (2 + 256 * 5 + 1)
+
+int main(int argc, char **argv) {
+    static uint8_t rom[0x100], cart[0x8000];
+    static cpu_t cpu;
+    int frames = argc > 1 ? atoi(argv[1]) : 20000;
+
+    cpu_init(&cpu, rom, cart, sizeof(cart));
+    cpu.rom_lock = 0;
+    cpu_map(&cpu);
+    for (int i = 0; i < (int) sizeof(code); ++i) {
+        cpu.ram[0xc000 + i] = code[i];
+    }
+    cpu.pc = 0xc000;
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    uint64_t cycles = 0;
+    for (int i = 0; i < frames; ++i) {
+        cpu.stop = 0;
+        int t = cpu_run(&cpu, FRAME_CYCLES);
+        if (t < 0) {
+            fprintf(stderr, "failed at %04x\n", cpu.pc);
+            return 1;
+        }
+        cycles += t;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    double instructions = (double) cycles / LOOP_CYCLES * LOOP_INSTRUCTIONS;
+
+    printf("%s: %.0f guest instructions, %.2f ns each\n", argv[0], instructions, ns / instructions);
+    return 0;
+}
+
+// vim: set sw=4 et:
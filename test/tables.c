@@ -0,0 +1,98 @@
+#include <stdio.h>
+
+#include "flags.h"
+
+// Checks flags_init()'s tables against the flags worked out from the
+// arithmetic itself, for every operand, and DAA against what it's for:
+// after ADD or SUB of two BCD bytes, A holds their BCD sum or difference
+// and C the carry or borrow out of it.
+
+static int bad;
+
+static void expect(char const *what, int i, int got, int want) {
+    if (got != want && ++bad <= 10) {
+        fprintf(stderr, "%s[%03x]: %x, want %x\n", what, i, got, want);
+    }
+}
+
+static uint8_t F(int z, int n, int h, int c) {
+    return z << 7 | n << 6 | h << 5 | c << 4;
+}
+
+static int bcd(int v) {
+    return v / 10 << 4 | v % 10;
+}
+
+static void check_alu(void) {
+    for (int a = 0; a < 0x100; ++a) {
+        for (int b = 0; b < 0x100; ++b) {
+            // Half carry and borrow out of bit 3 show in bit 4 of the
+            // result, against that of the operands.
+            int r = a + b;
+            expect("flags_add", a << 8 | b, flags_add[a << 8 | b],
+                   F((r & 0xff) == 0, 0, ((a ^ b ^ r) & 0x10) != 0, r >> 8 & 1));
+            r = a - b;
+            expect("flags_sub", a << 8 | b, flags_sub[a << 8 | b],
+                   F((r & 0xff) == 0, 1, ((a ^ b ^ r) & 0x10) != 0, r >> 8 & 1));
+        }
+
+        // Indexed by result: INC's operand was a - 1, DEC's a + 1.
+        int was = (a - 1) & 0xff;
+        expect("flags_inc", a, flags_inc[a], F(a == 0, 0, (was & 0xf) == 0xf, 0));
+        was = (a + 1) & 0xff;
+        expect("flags_dec", a, flags_dec[a], F(a == 0, 1, (was & 0xf) == 0x0, 0));
+    }
+}
+
+// A after DAA, and F, from the table.
+static void daa(uint8_t a, uint8_t f, uint8_t *r, uint8_t *rf) {
+    uint16_t v = flags_daa[(f & 0x70) << 4 | a];
+    *r = v & 0xff;
+    *rf = v >> 8;
+}
+
+static void check_daa(void) {
+    // Every A and N/H/C: the correction is 6 for a low digit past 9 or
+    // a half carry, 60 for a value past 99 or a carry (which it then
+    // keeps); after a subtraction, only the carries count.
+    for (int i = 0; i < 0x800; ++i) {
+        int a = i & 0xff, n = i >> 10 & 1, h = i >> 9 & 1, c = i >> 8 & 1;
+        int fix = 0;
+
+        if (h || (!n && (a & 0xf) > 0x9)) {
+            fix |= 0x06;
+        }
+        if (c || (!n && a > 0x99)) {
+            fix |= 0x60;
+            c = 1;
+        }
+        uint8_t r = n ? a - fix : a + fix;
+        expect("flags_daa", i, flags_daa[i], F(r == 0, n, 0, c) << 8 | r);
+    }
+
+    for (int x = 0; x < 100; ++x) {
+        for (int y = 0; y < 100; ++y) {
+            uint8_t a = bcd(x), b = bcd(y), r, f;
+            int i = x * 100 + y;
+
+            daa(a + b, flags_add[a << 8 | b], &r, &f);
+            expect("daa add", i, r, bcd((x + y) % 100));
+            expect("daa add F", i, f, F((x + y) % 100 == 0, 0, 0, x + y > 99));
+
+            daa(a - b, flags_sub[a << 8 | b], &r, &f);
+            expect("daa sub", i, r, bcd((x - y + 100) % 100));
+            expect("daa sub F", i, f, F(x == y, 1, 0, x < y));
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    flags_init();
+    check_alu();
+    check_daa();
+
+    printf("%s: %d mismatches\n", argv[0], bad);
+    return bad != 0;
+}
+
+// vim: set sw=4 et:
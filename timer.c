@@ -0,0 +1,97 @@
+#include "cpu.h"
+#include "sched.h"
+#include "timer.h"
+
+// The timer.  DIV is the top byte of a 16-bit counter that runs at the CPU
+// clock, and TIMA counts the falling edges of the counter bit TAC selects.
+// Neither is ticked: the counter is cpu->cycles - div_base, and TIMA is
+// tima plus the edges since tima_base, worked out when read.  Writes to
+// DIV, TIMA and TAC bring tima up to date and start counting afresh.  The
+// one thing that happens by itself, TIMA overflowing, is EVENT_TIMER.
+
+#define TAC_ON (1 << 2)
+
+// The counter bit TIMA counts, by TAC's low bits: 4096, 262144, 65536 and
+// 16384 Hz.
+static int const shifts[4] = { 10, 4, 6, 8 };
+
+// The edges of the selected bit between the last DIV reset and when.
+static uint64_t edges(cpu_t const *cpu, uint64_t when) {
+    return (when - cpu->timer.div_base) >> shifts[cpu->timer.tac & 3];
+}
+
+// No more than $FF: every core stops at the next scheduled event, so
+// EVENT_TIMER reloads TIMA before any instruction runs past its overflow.
+static uint8_t tima_now(cpu_t const *cpu) {
+    if (!(cpu->timer.tac & TAC_ON)) {
+        return cpu->timer.tima;
+    }
+
+    return cpu->timer.tima + edges(cpu, cpu->cycles) - edges(cpu, cpu->timer.tima_base);
+}
+
+static void catch_up(cpu_t *cpu) {
+    cpu->timer.tima = tima_now(cpu);
+    cpu->timer.tima_base = cpu->cycles;
+}
+
+// Schedules EVENT_TIMER for the edge that takes TIMA past $FF.
+static void schedule(cpu_t *cpu) {
+    if (!(cpu->timer.tac & TAC_ON)) {
+        sched_cancel(cpu, EVENT_TIMER);
+        return;
+    }
+
+    uint64_t edge = edges(cpu, cpu->timer.tima_base) + 0x100 - cpu->timer.tima;
+    sched_at(cpu, EVENT_TIMER, cpu->timer.div_base + (edge << shifts[cpu->timer.tac & 3]));
+}
+
+uint8_t timer_get_div(cpu_t const *cpu) {
+    return (cpu->cycles - cpu->timer.div_base) >> 8;
+}
+
+void timer_set_div(cpu_t *cpu, uint8_t v) {
+    catch_up(cpu);
+    cpu->timer.div_base = cpu->cycles;
+    schedule(cpu);
+}
+
+uint8_t timer_get_tima(cpu_t const *cpu) {
+    return tima_now(cpu);
+}
+
+void timer_set_tima(cpu_t *cpu, uint8_t v) {
+    catch_up(cpu);
+    cpu->timer.tima = v;
+    schedule(cpu);
+}
+
+uint8_t timer_get_tac(cpu_t const *cpu) {
+    return cpu->timer.tac | 0xf8;
+}
+
+void timer_set_tac(cpu_t *cpu, uint8_t v) {
+    catch_up(cpu);
+    cpu->timer.tac = v & 0x7;
+    schedule(cpu);
+}
+
+uint64_t timer_next_div(cpu_t const *cpu, uint64_t from) {
+    return cpu->timer.div_base + ((((from - cpu->timer.div_base) >> 8) + 1) << 8);
+}
+
+uint64_t timer_next_tima(cpu_t const *cpu, uint64_t from) {
+    if (!(cpu->timer.tac & TAC_ON)) {
+        return SCHED_NEVER;
+    }
+    return cpu->timer.div_base + ((edges(cpu, from) + 1) << shifts[cpu->timer.tac & 3]);
+}
+
+void timer_overflow(cpu_t *cpu, uint64_t due) {
+    cpu->timer.tima = cpu->timer.tma;
+    cpu->timer.tima_base = due;
+    cpu_interrupt(cpu, INT_TIMER);
+    schedule(cpu);
+}
+
+// vim: set sw=4 et:
@@ -0,0 +1,25 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "cpu.h"
+
+// I/O handlers for DIV, TIMA and TAC ($FF04, $FF05, $FF07).
+uint8_t timer_get_div(cpu_t const *cpu);
+void timer_set_div(cpu_t *cpu, uint8_t v);
+uint8_t timer_get_tima(cpu_t const *cpu);
+void timer_set_tima(cpu_t *cpu, uint8_t v);
+uint8_t timer_get_tac(cpu_t const *cpu);
+void timer_set_tac(cpu_t *cpu, uint8_t v);
+
+// The cycle after from at which DIV, or TIMA, next counts up; SCHED_NEVER
+// for TIMA while it's stopped.
+uint64_t timer_next_div(cpu_t const *cpu, uint64_t from);
+uint64_t timer_next_tima(cpu_t const *cpu, uint64_t from);
+
+// Reloads TIMA from TMA and requests the timer interrupt, when
+// EVENT_TIMER comes due at cycle due, and schedules the next overflow.
+void timer_overflow(cpu_t *cpu, uint64_t due);
+
+#endif
+
+// vim: set sw=4 et:
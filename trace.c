@@ -0,0 +1,54 @@
+// The tracing build of the core: cpu.c's decoder, handlers and step()
+// compiled again with disassembly turned on, under their own names so the
+// normal build carries none of it.
+#define CPU_TRACE
+#define ops trace_ops
+#define cb_ops trace_cb_ops
+#define ops_init trace_ops_init
+#define step trace_step
+#define step_halt_bug trace_step_halt_bug
+
+#include "cpu.c"
+
+int trace_run(cpu_t *cpu, int budget) {
+    int elapsed = 0;
+
+    ops_init();
+
+    // Takes interrupts and sees to HALT itself, and stops for the next
+    // event or a breakpoint, as run_cycles() does between cpu_run()s.
+    do {
+        uint64_t left = cpu->sched.next > cpu->cycles ? cpu->sched.next - cpu->cycles : 0;
+        if (left < (uint64_t) (budget - elapsed)) {
+            budget = elapsed + left;
+        }
+        if (elapsed >= budget) {
+            break;
+        }
+
+        int t;
+        cpu->stop = 0;
+        if (cpu->halted) {
+            t = halt_wait(cpu, budget - elapsed);
+        } else if (cpu->ime && cpu->ram[0xffff] & cpu->ram[0xff0f] & 0x1f) {
+            t = take_interrupt(cpu);
+        } else {
+            int ei = cpu->ei, halt_bug = cpu->halt_bug;
+            cpu->halt_bug = 0;
+            t = halt_bug ? step_halt_bug(cpu) : step(cpu);
+            if (t < 0) {
+                return t;
+            }
+            cpu->cycles += t;
+            if (ei && cpu->ei) {
+                cpu->ime = 1;
+                cpu->ei = 0;
+            }
+        }
+        elapsed += t;
+    } while (elapsed < budget && !cpu_at_break(cpu));
+
+    return elapsed;
+}
+
+// vim: set sw=4 et: